@@ -12,7 +12,7 @@ inline xsdt *xsdt_ptr = NULL;
 template <typename T>
 T *find_SDT(const char *signature) {
     if(xsdt_ptr != NULL) {
-        for(size_t i = 0; i < (xsdt_ptr->acpihdr_ptr.length - sizeof(acpihdr)); i++) {
+        for(size_t i = 0; i < (xsdt_ptr->acpihdr_ptr.length - sizeof(acpihdr)) / sizeof(uint64_t); i++) {
             acpihdr *acpihdr_ptr = reinterpret_cast<acpihdr*>(xsdt_ptr->acpiptr[i] + vmm::high_vma);
             if(strncmp(acpihdr_ptr->signature, signature, 4) == 0) {
                 print("[ACPI] {s} found\n", signature);
@@ -22,7 +22,7 @@ T *find_SDT(const char *signature) {
     } 
 
     if(rsdt_ptr != NULL) {
-        for(size_t i = 0; i < (rsdt_ptr->acpihdr_ptr.length - sizeof(acpihdr)); i++) {
+        for(size_t i = 0; i < (rsdt_ptr->acpihdr_ptr.length - sizeof(acpihdr)) / sizeof(uint32_t); i++) {
             acpihdr *acpihdr_ptr = reinterpret_cast<acpihdr*>(rsdt_ptr->acpiptr[i] + vmm::high_vma);
             if(strncmp(acpihdr_ptr->signature, signature, 4) == 0) {
                 print("[ACPI] {s} found\n", signature);
@@ -0,0 +1,51 @@
+#ifndef SRAT_HPP_
+#define SRAT_HPP_
+
+#include <acpi/tables.hpp>
+#include <acpi/rsdt.hpp>
+
+struct [[gnu::packed]] srat {
+    acpihdr acpihdr_ptr;
+    uint32_t reserved0;
+    uint64_t reserved1;
+    uint8_t entries[];
+};
+
+struct [[gnu::packed]] srat0 {
+    uint8_t domain_low;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t domain_high[3];
+    uint32_t clock_domain;
+};
+
+struct [[gnu::packed]] srat1 {
+    uint32_t domain;
+    uint16_t reserved0;
+    uint64_t base;
+    uint64_t length;
+    uint32_t reserved1;
+    uint32_t flags;
+    uint64_t reserved2;
+};
+
+struct [[gnu::packed]] srat2 {
+    uint16_t reserved0;
+    uint32_t domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved1;
+};
+
+struct [[gnu::packed]] slit {
+    acpihdr acpihdr_ptr;
+    uint64_t locality_cnt;
+    uint8_t entries[];
+};
+
+inline srat *srat_ptr = NULL;
+inline slit *slit_ptr = NULL;
+
+#endif
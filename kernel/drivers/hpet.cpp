@@ -3,11 +3,23 @@
 static hpet_table *hpet_table_ptr;
 static hpet *hpet_ptr;
 
+static uint64_t deadline(uint64_t ms) {
+    return hpet_ptr->counter_value + (ms * 1000000000000) / ((hpet_ptr->capabilities >> 32) & 0xffffffff);
+}
+
 void ksleep(uint64_t ms) {
-    uint64_t ticks = hpet_ptr->counter_value + (ms * 1000000000000) / ((hpet_ptr->capabilities >> 32) & 0xffffffff); 
+    uint64_t ticks = deadline(ms);
     for(;hpet_ptr->counter_value < ticks;); 
 }
 
+// halts between interrupts instead of spinning, so a kernel thread gives its cpu to whatever the next timer tick
+// schedules. only for threads that run with interrupts on once the apic timer is up
+void ksleep_idle(uint64_t ms) {
+    uint64_t ticks = deadline(ms);
+    while(hpet_ptr->counter_value < ticks)
+        asm volatile ("sti\n" "hlt" ::: "memory");
+}
+
 void init_hpet() {
     hpet_table_ptr = find_SDT<hpet_table>("HPET");
     hpet_ptr = reinterpret_cast<hpet*>(hpet_table_ptr->address + vmm::high_vma);
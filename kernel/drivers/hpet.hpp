@@ -31,6 +31,7 @@ struct [[gnu::packed]] hpet {
 };
 
 void ksleep(size_t ms);
+void ksleep_idle(size_t ms);
 void init_hpet();
 
 #endif
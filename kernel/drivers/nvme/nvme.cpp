@@ -14,8 +14,30 @@ struct msd : dev::msd {
     ssize_t write(size_t off, size_t cnt, void *buf);
 };
 
+struct alignas(0x1000) io_buffer {
+    uint8_t data[0x1000];
+};
+
+static kmm::object_cache<io_buffer> io_buffer_cache("nvme_io_buffer");
+
+static uint8_t *alloc_lba_buffer(size_t size) {
+    if(size <= sizeof(io_buffer))
+        return io_buffer_cache.alloc()->data;
+
+    return reinterpret_cast<uint8_t*>(pmm::alloc(div_roundup(size, vmm::page_size)) + vmm::high_vma);
+}
+
+static void free_lba_buffer(uint8_t *buffer, size_t size) {
+    if(size <= sizeof(io_buffer)) {
+        io_buffer_cache.free(reinterpret_cast<io_buffer*>(buffer));
+        return;
+    }
+
+    pmm::free(reinterpret_cast<size_t>(buffer) - vmm::high_vma, div_roundup(size, vmm::page_size));
+}
+
 ssize_t msd::read(size_t off, size_t cnt, void *buf) {
-    smp::cpu local = smp::core_local();
+    smp::cpu &local = smp::core_local();
     device *dev = local.nvme_io_queue->parent;
 
     ns &active_namespace = dev->namespace_list[partition_index];
@@ -23,19 +45,19 @@ ssize_t msd::read(size_t off, size_t cnt, void *buf) {
     size_t lba_start = off / active_namespace.lba_size;
     size_t lba_cnt = div_roundup(cnt, active_namespace.lba_size);
 
-    uint8_t *lba_buffer = reinterpret_cast<uint8_t*>(pmm::alloc(div_roundup(lba_cnt * active_namespace.lba_size, vmm::page_size)) + vmm::high_vma); 
+    uint8_t *lba_buffer = alloc_lba_buffer(lba_cnt * active_namespace.lba_size);
 
     active_namespace.rw_lba(lba_buffer, lba_start, lba_cnt, 0);
     size_t lba_offset = off % active_namespace.lba_size;
     memcpy8(reinterpret_cast<uint8_t*>(buf), lba_buffer + lba_offset, cnt);
 
-    pmm::free(reinterpret_cast<size_t>(lba_buffer) - vmm::high_vma, div_roundup(lba_cnt * active_namespace.lba_size, vmm::page_size));
+    free_lba_buffer(lba_buffer, lba_cnt * active_namespace.lba_size);
 
     return cnt;
 }
 
 ssize_t msd::write(size_t off, size_t cnt, void *buf) {
-    smp::cpu local = smp::core_local();
+    smp::cpu &local = smp::core_local();
     device *dev = local.nvme_io_queue->parent;
 
     ns &active_namespace = dev->namespace_list[partition_index];
@@ -43,14 +65,14 @@ ssize_t msd::write(size_t off, size_t cnt, void *buf) {
     size_t lba_start = off / active_namespace.lba_size;
     size_t lba_cnt = div_roundup(cnt, active_namespace.lba_size);
 
-    uint8_t *lba_buffer = reinterpret_cast<uint8_t*>(pmm::alloc(div_roundup(lba_cnt * active_namespace.lba_size, vmm::page_size)) + vmm::high_vma); 
+    uint8_t *lba_buffer = alloc_lba_buffer(lba_cnt * active_namespace.lba_size);
 
     active_namespace.rw_lba(lba_buffer, lba_start, lba_cnt, 0);
     size_t lba_offset = off % active_namespace.lba_size;
     memcpy8(lba_buffer + lba_offset, reinterpret_cast<uint8_t*>(buf), cnt);
     active_namespace.rw_lba(lba_buffer, lba_start, lba_cnt, 1);
 
-    pmm::free(reinterpret_cast<size_t>(lba_buffer) - vmm::high_vma, div_roundup(lba_cnt * active_namespace.lba_size, vmm::page_size));
+    free_lba_buffer(lba_buffer, lba_cnt * active_namespace.lba_size);
 
     return cnt;
 }
@@ -180,7 +202,7 @@ device::device(pci::device pci_device) : pci_device(pci_device), qid_cnt(0), loc
 
     for(size_t i = 0; i < smp::cpus.size(); i++) {
         smp::cpus[i].nvme_io_queue = new queue;
-        *smp::cpus[i].nvme_io_queue = queue(this, qid_cnt++);
+        *smp::cpus[i].nvme_io_queue = queue(this, qid_cnt++, smp::cpus[i].numa_node);
         create_io_queue(*smp::cpus[i].nvme_io_queue);
     }
 
@@ -281,9 +303,9 @@ int device::create_io_queue(queue new_queue) {
     return 0;
 }
 
-queue::queue(device *parent, ssize_t qid) : qid(qid), sq_head(0), sq_tail(0), cq_head(0), cq_tail(0), phase(1), parent(parent) {
-    submission_queue = reinterpret_cast<command*>(pmm::alloc(div_roundup(parent->queue_entries * sizeof(command), vmm::page_size)) + vmm::high_vma);
-    completion_queue = reinterpret_cast<completion*>(pmm::alloc(div_roundup(parent->queue_entries * sizeof(completion), vmm::page_size)) + vmm::high_vma);
+queue::queue(device *parent, ssize_t qid, size_t numa_node) : qid(qid), sq_head(0), sq_tail(0), cq_head(0), cq_tail(0), phase(1), parent(parent) {
+    submission_queue = reinterpret_cast<command*>(pmm::alloc_node(div_roundup(parent->queue_entries * sizeof(command), vmm::page_size), numa_node) + vmm::high_vma);
+    completion_queue = reinterpret_cast<completion*>(pmm::alloc_node(div_roundup(parent->queue_entries * sizeof(completion), vmm::page_size), numa_node) + vmm::high_vma);
     submission_doorbell = reinterpret_cast<uint32_t*>(reinterpret_cast<size_t>(parent->registers) + vmm::page_size + (2 * qid * (4 << parent->strides)));
     completion_doorbell = reinterpret_cast<uint32_t*>(reinterpret_cast<size_t>(parent->registers) + vmm::page_size + ((2 * qid + 1) * (4 << parent->strides)));
 }
@@ -330,7 +352,7 @@ int ns::rw_lba(void *buf, size_t start, size_t cnt, bool rw) {
     new_command.rw.length = cnt - 1;
     new_command.rw.prp1 = reinterpret_cast<size_t>(buf) - vmm::high_vma;
 
-    smp::cpu local = smp::core_local();
+    smp::cpu &local = smp::core_local();
 
     if(local.nvme_io_queue->send_cmd(new_command))
         return -1;
@@ -263,7 +263,7 @@ struct [[gnu::packed]] namespace_id {
 class device;
 
 struct queue {
-    queue(device *parent, ssize_t qid);
+    queue(device *parent, ssize_t qid, size_t numa_node = 0);
     queue() = default;
     
     uint16_t send_cmd(command cmd);
@@ -1,4 +1,6 @@
 #include <fs/fd.hpp>
+#include <mm/page_cache.hpp>
+#include <mm/shm.hpp>
 #include <types.hpp>
 #include <string.hpp>
 #include <sched/smp.hpp>
@@ -16,11 +18,13 @@
 
 namespace fs {
 
-static fd &alloc_fd(lib::string path, int flags) {
+static kmm::object_cache<fd_state> fd_state_cache("fd_state");
+
+static size_t alloc_index() {
     smp::cpu &core = smp::core_local();
     sched::task &current_task = sched::task_list[core.pid];
 
-    const auto index = [](sched::task &task) {
+    return [](sched::task &task) {
         const auto find_index = [](sched::task &task, const auto &func) -> size_t {
             for(size_t i = 0; i < task.fd_list.bitmap_size; i++) {
                 if(!bm_test(task.fd_list.bitmap, i)) {
@@ -37,10 +41,18 @@ static fd &alloc_fd(lib::string path, int flags) {
 
         return find_index(task, find_index);
     } (current_task);
+}
 
+static fd &alloc_fd(lib::string path, int flags) {
+    size_t index = alloc_index();
     return (fd_list[index] = fd(path, flags, index));
 }
 
+static fd &alloc_fd(vfs::node *vfs_node, int flags) {
+    size_t index = alloc_index();
+    return (fd_list[index] = fd(vfs_node, flags, index));
+}
+
 std::pair<ssize_t, fd&&> translate(int index) {
     std::pair<ssize_t, fd&&> ret = { .first = -1, .second = fd() };
 
@@ -85,8 +97,27 @@ fd::fd(lib::string path, int flags, int backing_fd) : status(0), backing_fd(back
     if(open == -1)
         return;
 
-    _loc = (size_t*)kmm::calloc(sizeof(size_t)); 
-    _flags = (size_t*)kmm::calloc(sizeof(size_t));
+    fd_state *state = fd_state_cache.alloc();
+    state->loc = 0;
+    state->flags = 0;
+
+    _loc = &state->loc;
+    _flags = &state->flags;
+
+    status = 1;
+}
+
+// opens a node that is already known, such as one without a path in the tree
+fd::fd(vfs::node *vfs_node, int flags, int backing_fd) : status(0), backing_fd(backing_fd), vfs_node(vfs_node) {
+    if(vfs_node->filesystem->open(vfs_node, flags) == -1)
+        return;
+
+    fd_state *state = fd_state_cache.alloc();
+    state->loc = 0;
+    state->flags = 0;
+
+    _loc = &state->loc;
+    _flags = &state->flags;
 
     status = 1;
 }
@@ -116,6 +147,8 @@ int fd::write(void *buf, size_t cnt) {
     if(ret == -1)
         return -1;
 
+    mm::page_cache_write(vfs_node, *_loc, buf, ret);
+
     *_loc += cnt; 
 
     return ret;
@@ -156,9 +189,25 @@ extern "C" int syscall_open(regs *regs_cur) {
     return regs_cur->rax;
 }
 
+// closes every fd set in an exited task's bitmap, so each filesystem drops what the fd held
+void close_all(uint8_t *bitmap, size_t bitmap_size) {
+    for(size_t i = 0; i < bitmap_size; i++) {
+        if(!bm_test(bitmap, i))
+            continue;
+
+        auto status = translate(i);
+        if(status.first == -1)
+            continue;
+
+        status.second.vfs_node->filesystem->close(status.second.vfs_node);
+        fd_list.remove(i);
+    }
+}
+
 extern "C" int syscall_close(regs *regs_cur) {
     SYSCALL_FD_TRANSLATE(regs_cur->rdi);
 
+    status.second.vfs_node->filesystem->close(status.second.vfs_node);
     fd_list.remove(regs_cur->rdi);
 
     return (regs_cur->rax = 0);
@@ -185,7 +234,16 @@ extern "C" int syscall_seek(regs *regs_cur) {
 extern "C" int syscall_dup(regs *regs_cur) {
     SYSCALL_FD_TRANSLATE(regs_cur->rdi);
 
-    return (regs_cur->rax = alloc_fd(status.second.vfs_node->absolute_path, *status.second._flags).backing_fd); 
+    fd &new_fd = alloc_fd(status.second.vfs_node, *status.second._flags);
+
+    regs_cur->rax = new_fd.backing_fd;
+
+    if(new_fd.status == 0) {
+        regs_cur->rax = -1;
+        return -1;
+    }
+
+    return regs_cur->rax;
 }
 
 extern "C" int syscall_dup2(regs *regs_cur) {
@@ -195,12 +253,46 @@ extern "C" int syscall_dup2(regs *regs_cur) {
     SYSCALL_FD_TRANSLATE(regs_cur->rdi);
 
     auto new_fd_status = translate(regs_cur->rsi);
-    if(new_fd_status.first != -1)
+    if(new_fd_status.first != -1) {
+        new_fd_status.second.vfs_node->filesystem->close(new_fd_status.second.vfs_node);
         fd_list.remove(regs_cur->rsi);
+    }
+
+    if(mm::is_shm(status.second.vfs_node))
+        mm::shm_ref(status.second.vfs_node);
 
     fd_list[regs_cur->rsi] = status.second;
 
     return regs_cur->rsi;
 }
 
+extern "C" int syscall_memfd_create(regs *regs_cur) {
+    lib::string name((char*)regs_cur->rdi);
+
+    vfs::node *object = mm::shm_create(name, 0);
+
+    fd &new_fd = alloc_fd(object, regs_cur->rsi);
+    mm::shm_unref(object);
+
+    regs_cur->rax = new_fd.backing_fd;
+
+    if(new_fd.status == 0) {
+        regs_cur->rax = -1;
+        return -1;
+    }
+
+    return regs_cur->rax;
+}
+
+extern "C" int syscall_ftruncate(regs *regs_cur) {
+    SYSCALL_FD_TRANSLATE(regs_cur->rdi);
+
+    if((ssize_t)regs_cur->rsi < 0) {
+        set_errno(einval);
+        return (regs_cur->rax = -1);
+    }
+
+    return (regs_cur->rax = status.second.vfs_node->filesystem->truncate(status.second.vfs_node, regs_cur->rsi));
+}
+
 }
@@ -5,8 +5,14 @@
 
 namespace fs {
 
+struct fd_state {
+    size_t loc;
+    size_t flags;
+};
+
 struct fd {
     fd(lib::string path, int flags, int backing_fd);
+    fd(vfs::node *vfs_node, int flags, int backing_fd);
     fd(int backing_fd);
     fd() : status(0), backing_fd(-1) { }
 
@@ -25,6 +31,8 @@ struct fd {
 
 inline lib::map<ssize_t, fd> fd_list;
 
+void close_all(uint8_t *bitmap, size_t bitmap_size);
+
 }
 
 #endif
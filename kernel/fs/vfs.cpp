@@ -1,7 +1,15 @@
 #include <fs/vfs.hpp>
 #include <fs/devfs.hpp>
+#include <mm/page_cache.hpp>
  
 namespace vfs {
+
+struct node_object {
+    node vfs_node;
+    stat stat_buf;
+};
+
+static kmm::object_cache<node_object> node_cache("vfs_node");
  
 node::node(lib::string absolute_path, lib::string relative_path, lib::string name, fs *filesystem, default_ioctl *ioctl_device) :
     absolute_path(absolute_path),
@@ -130,13 +138,16 @@ node *create_node(node *parent, lib::string name) {
         relative_path = lib::string(absolute_path.data() + parent->filesystem->mount_gate.length());
     }
  
-    node *new_node = reinterpret_cast<node*>(kmm::calloc(sizeof(node)));
+    node_object *object = node_cache.alloc();
+    memset8(reinterpret_cast<uint8_t*>(object), 0, sizeof(node_object));
+
+    node *new_node = &object->vfs_node;
  
     new_node->absolute_path = absolute_path;
     new_node->relative_path = relative_path;
     new_node->name = name;
     new_node->filesystem = parent->filesystem;
-    new_node->stat_cur = (stat*)kmm::calloc(sizeof(stat));
+    new_node->stat_cur = &object->stat_buf;
  
     new_node->parent = parent;
     node *cur = parent;
@@ -173,6 +184,7 @@ void node::remove_cluster(node *cur) {
             remove_cluster(cur->child);
         }
         cur->last->next = 0;
+        mm::page_cache_evict(cur);
         delete cur;
         cur = cur->next;
     }
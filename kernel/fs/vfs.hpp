@@ -89,6 +89,15 @@ struct fs {
         return -1;
     }
 
+    virtual int truncate(node *vfs_node, off_t length) {
+        print("Warning: unimplemented filesystem call on node {} truncate<{}>\n", vfs_node->absolute_path, length);
+        return -1;
+    }
+
+    virtual int close([[maybe_unused]] node *vfs_node) {
+        return 0;
+    }
+
     lib::string mount_gate;
 
     static constexpr size_t nofs_signature = (1 << 0);
@@ -96,6 +105,7 @@ struct fs {
     static constexpr size_t fat32_signature = (1 << 2);
     static constexpr size_t ramfs_signature = (1 << 3);
     static constexpr size_t is_mounted = (1 << 4);
+    static constexpr size_t shmfs_signature = (1 << 5);
 
     size_t flags;
 };
@@ -4,6 +4,7 @@
 #include <sched/scheduler.hpp>
 #include <int/apic.hpp>
 #include <int/idt.hpp>
+#include <mm/mmap.hpp>
 #include <debug.hpp>
 #include <cpu.hpp>
 
@@ -22,7 +23,7 @@ Func *const func_array<Func>::data[] = {
     disr, disr, disr, disr, disr, disr, disr, disr, 
     disr, disr, disr, disr, disr, disr, disr, disr,
     disr, disr, disr, disr, disr, disr, disr, disr, // 32
-    sched::reschedule, tty::ps2_keyboard, disr, disr, disr, disr, disr, disr, 
+    sched::reschedule, tty::ps2_keyboard, vmm::tlb_shootdown_handler, disr, disr, disr, disr, disr, 
     disr, disr, disr, disr, disr, disr, disr, disr, 
     disr, disr, disr, disr, disr, disr, disr, disr, 
     disr, disr, disr, disr, disr, disr, disr, disr, // 64
@@ -64,6 +65,22 @@ void set_idt_entry(uint16_t cs, uint8_t ist, uint8_t attributes, uint64_t offset
 }
 
 extern "C" void isr_handler_main(regs *regs_cur) {
+    if(regs_cur->isr_number == 14 && smp::percpu_online) {
+        uint64_t cr2;
+        asm volatile ("mov %%cr2, %0" : "=r"(cr2));
+
+        if(regs_cur->cs & 0x3)
+            swapgs();
+
+        ssize_t ret = mm::page_fault(smp::core_local().page_map, cr2, regs_cur->err_code);
+
+        if(regs_cur->cs & 0x3)
+            swapgs();
+
+        if(ret == 0)
+            return;
+    }
+
     if(regs_cur->isr_number < 32) {
         static char lock = 0;
         spin_lock(&lock);
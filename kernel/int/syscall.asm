@@ -52,6 +52,11 @@ extern syscall_set_gs_base
 extern syscall_get_fs_base
 extern syscall_get_gs_base
 extern syscall_syslog
+extern syscall_alloc_report
+extern syscall_fork
+extern syscall_exit
+extern syscall_memfd_create
+extern syscall_ftruncate
 
 syscall_list:
 
@@ -69,6 +74,11 @@ dq syscall_set_gs_base
 dq syscall_get_fs_base
 dq syscall_get_gs_base
 dq syscall_syslog
+dq syscall_alloc_report
+dq syscall_fork
+dq syscall_exit
+dq syscall_memfd_create
+dq syscall_ftruncate
 
 .end:
 
@@ -10,12 +10,21 @@ void cpu_init_features() {
     uint64_t cr0 = 0;
     asm volatile ( "mov %%cr0, %0" : "=r"(cr0));
     cr0 &= ~(1 << 2);
-    cr0 |= (1 << 1);
+    cr0 |= (1 << 1) | (1 << 16); // WP so kernel writes to user memory honour copy-on-write
     asm volatile ( "mov %0, %%cr0" :: "r"(cr0));
 
     uint64_t cr4;
     asm volatile ( "mov %%cr4, %0" : "=r"(cr4));
     cr4 |= (1 << 7) | (1 << 9) | (1 << 10);
+
+    if(cpuid(1, 0).rcx & (1 << 17)) { // PCID
+        cr4 |= (1 << 17);
+        vmm::pcid_enabled = true;
+    }
+
+    if(cpuid(7, 0).rbx & (1 << 10)) // INVPCID
+        vmm::invpcid_enabled = true;
+
     asm volatile ( "mov %0, %%cr4" :: "r"(cr4));
 
     wrmsr(msr_star, 0x0013000800000000);
@@ -26,7 +35,7 @@ void cpu_init_features() {
 extern "C" void syscall_set_fs_base(regs *regs_cur) {
     smp::cpu &core = smp::core_local();
     sched::task &current_task = sched::task_list[core.pid];
-    sched::thread &current_thread = current_task.threads[core.tid];
+    sched::thread &current_thread = *current_task.threads[core.tid];
 
     set_user_fs(regs_cur->rdi);
 
@@ -36,7 +45,7 @@ extern "C" void syscall_set_fs_base(regs *regs_cur) {
 extern "C" void syscall_set_gs_base(regs *regs_cur) {
     smp::cpu &core = smp::core_local();
     sched::task &current_task = sched::task_list[core.pid];
-    sched::thread &current_thread = current_task.threads[core.tid];
+    sched::thread &current_thread = *current_task.threads[core.tid];
 
     set_user_gs(regs_cur->rdi);
 
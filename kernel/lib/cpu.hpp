@@ -105,7 +105,7 @@ inline cpuid_state cpuid(size_t leaf, size_t subleaf) {
         return ret;
     }
 
-    asm volatile ("cpuid" : "=a"(ret.rax), "=b"(ret.rbx), "=c"(ret.rcx), "=d"(ret.rbx) : "a"(leaf), "c"(subleaf));
+    asm volatile ("cpuid" : "=a"(ret.rax), "=b"(ret.rbx), "=c"(ret.rcx), "=d"(ret.rdx) : "a"(leaf), "c"(subleaf));
 
     return ret;
 }
@@ -138,11 +138,32 @@ inline uintptr_t get_user_fs(void) {
     return rdmsr(msr_fs_base);
 }
 
+inline size_t irq_save() {
+    size_t rflags;
+    asm volatile ("pushfq\npop %0\ncli" : "=r"(rflags) :: "memory");
+    return rflags;
+}
+
+inline void irq_restore(size_t rflags) {
+    asm volatile ("push %0\npopfq" :: "r"(rflags) : "memory", "cc");
+}
+
+inline uint64_t rdtsc() {
+    uint32_t lo, hi;
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return (static_cast<uint64_t>(hi) << 32) | lo;
+}
+
 template <typename T>
 void spin_lock(T *lock) {
     while(__atomic_test_and_set(lock, __ATOMIC_ACQUIRE));
 }
 
+template <typename T>
+bool spin_trylock(T *lock) {
+    return !__atomic_test_and_set(lock, __ATOMIC_ACQUIRE);
+}
+
 template <typename T>
 void spin_release(T *lock) {
     __atomic_clear(lock, __ATOMIC_RELEASE);
@@ -55,6 +55,13 @@ file::file(vmm::pmlx_table *page_map, aux *aux_cur, fs::fd &file, uint64_t base,
         size_t misalignment = phdr[i].p_vaddr & (vmm::page_size - 1);
         size_t page_cnt = div_roundup(misalignment + phdr[i].p_memsz, vmm::page_size);
 
+        // read-only segments without bss are mapped from the page cache and shared by every task running the file
+        if(!(phdr[i].p_flags & pf_w) && phdr[i].p_filesz == phdr[i].p_memsz && (phdr[i].p_offset & (vmm::page_size - 1)) == misalignment) {
+            void *addr = mm::mmap_file(page_map, (void*)(phdr[i].p_vaddr - misalignment + base), page_cnt * vmm::page_size, 0x1 | (1 << 2), mm::map_private | mm::map_fixed, file.vfs_node, phdr[i].p_offset - misalignment);
+            if(addr != (void*)mm::map_failed)
+                continue;
+        }
+
         mm::mmap(page_map, (void*)(phdr[i].p_vaddr + base), page_cnt * vmm::page_size, 0x3 | (1 << 2), mm::map_anonymous | mm::map_fixed, 0, 0);
 
         file.seek(phdr[i].p_offset, seek_set);
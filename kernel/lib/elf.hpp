@@ -57,6 +57,10 @@ constexpr size_t pt_hois = 0x6fffffff;
 constexpr size_t pt_loproc = 0x70000000;
 constexpr size_t pt_hiproc = 0x7fffffff;
 
+constexpr size_t pf_x = 0x1;
+constexpr size_t pf_w = 0x2;
+constexpr size_t pf_r = 0x4;
+
 struct elf64_shdr {
     uint32_t sh_name;
     uint32_t sh_type;
@@ -21,6 +21,13 @@ void memset64(uint64_t *src, uint64_t data, size_t count) {
     }
 }
 
+void memset64_nt(uint64_t *src, uint64_t data, size_t count) {
+    for(size_t i = 0; i < count; i++) {
+        asm volatile ("movnti %1, %0" : "=m"(*src++) : "r"(data));
+    }
+    asm volatile ("sfence" ::: "memory");
+}
+
 void memcpy8(uint8_t *dest, uint8_t *src, size_t count) {
     for(size_t i = 0; i < count; i++) {
         *dest++ = *src++;
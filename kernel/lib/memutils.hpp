@@ -126,6 +126,7 @@ void memset8(uint8_t *src, uint8_t data, size_t count);
 void memset16(uint16_t *src, uint16_t data, size_t count);
 void memset32(uint32_t *src, uint32_t data, size_t count);
 void memset64(uint64_t *src, uint64_t data, size_t count);
+void memset64_nt(uint64_t *src, uint64_t data, size_t count);
 
 void memcpy8(uint8_t *dest, uint8_t *src, size_t count);
 void memcpy16(uint16_t *dest, uint16_t *src, size_t count);
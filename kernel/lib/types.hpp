@@ -50,6 +50,7 @@ constexpr size_t o_cloexec = 0x4000;
 constexpr size_t ebadf = 1008;
 constexpr size_t enoent = 1043;
 constexpr size_t einval = 1026;
+constexpr size_t enomem = 1052;
 
 struct timespec {
     time_t tv_sec;
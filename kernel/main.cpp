@@ -1,6 +1,10 @@
 #include <mm/vmm.hpp>
 #include <mm/pmm.hpp>
 #include <mm/slab.hpp>
+#include <mm/mmap.hpp>
+#include <mm/page_cache.hpp>
+#include <mm/profile.hpp>
+#include <mm/numa.hpp>
 
 #include <int/idt.hpp>
 #include <int/gdt.hpp>
@@ -57,22 +61,37 @@ extern "C" int main(size_t stivale_phys) {
 
     stivale_virt = reinterpret_cast<stivale*>(stivale_phys + vmm::high_vma);
 
+    rsdp_ptr = reinterpret_cast<rsdp*>(stivale_virt->rsdp + vmm::high_vma);
+
+    if(rsdp_ptr->xsdt_addr) {
+        xsdt_ptr = reinterpret_cast<xsdt*>(rsdp_ptr->xsdt_addr + vmm::high_vma);
+        print("[ACPI] xsdt found at {x}\n", reinterpret_cast<size_t>(xsdt_ptr));
+    } else if(rsdp_ptr->rsdt_addr) {
+        rsdt_ptr = reinterpret_cast<rsdt*>(rsdp_ptr->rsdt_addr + vmm::high_vma);
+        print("[ACPI] rsdt found at {x}\n", reinterpret_cast<size_t>(rsdt_ptr));
+    }
+
+    numa::init();
+
     pmm::init(stivale_virt);
 
-    kmm::cache(NULL, 0, 32);
-    kmm::cache(NULL, 0, 64);
-    kmm::cache(NULL, 0, 128);
-    kmm::cache(NULL, 0, 256);
-    kmm::cache(NULL, 0, 512);
-    kmm::cache(NULL, 0, 1024);
-    kmm::cache(NULL, 0, 2048);
-    kmm::cache(NULL, 0, 4096);
-    kmm::cache(NULL, 0, 8192);
-    kmm::cache(NULL, 0, 16384);
-    kmm::cache(NULL, 0, 32768);
-    kmm::cache(NULL, 0, 65536);
-    kmm::cache(NULL, 0, 131072);
-    kmm::cache(NULL, 0, 262144);
+    kmm::create_cache(NULL, 32);
+    kmm::create_cache(NULL, 64);
+    kmm::create_cache(NULL, 128);
+    kmm::create_cache(NULL, 256);
+    kmm::create_cache(NULL, 512);
+    kmm::create_cache(NULL, 1024);
+    kmm::create_cache(NULL, 2048);
+    kmm::create_cache(NULL, 4096);
+    kmm::create_cache(NULL, 8192);
+    kmm::create_cache(NULL, 16384);
+    kmm::create_cache(NULL, 32768);
+    kmm::create_cache(NULL, 65536);
+    kmm::create_cache(NULL, 131072);
+    kmm::create_cache(NULL, 262144);
+
+    pmm::register_shrinker(kmm::shrink);
+    pmm::register_shrinker(mm::page_cache_shrink);
 
     vmm::init();
 
@@ -83,29 +102,29 @@ extern "C" int main(size_t stivale_phys) {
 
     new x86::tss;
 
-    rsdp_ptr = reinterpret_cast<rsdp*>(stivale_virt->rsdp + vmm::high_vma);
-
-    if(rsdp_ptr->xsdt_addr) {
-        xsdt_ptr = reinterpret_cast<xsdt*>(rsdp_ptr->xsdt_addr + vmm::high_vma);
-        print("[ACPI] xsdt found at {x}\n", reinterpret_cast<size_t>(xsdt_ptr));
-    } else if(rsdp_ptr->rsdt_addr) {
-        rsdt_ptr = reinterpret_cast<rsdt*>(rsdp_ptr->rsdt_addr + vmm::high_vma);
-        print("[ACPI] rsdt found at {x}\n", reinterpret_cast<size_t>(rsdt_ptr));
-    }
-
     cpu_init_features();
     init_hpet();
 
     apic::init();
     smp::boot_aps();
+    profile::init();
 
     pci::scan_devices();
 
     apic::timer_calibrate(100);
 
+    vmm::switch_bench();
+    kmm::slab_bench();
+
     ssize_t pid = sched::create_task(-1, NULL);
     sched::create_thread(pid, (size_t)kernel_thread, 0x8, NULL, NULL, NULL);
 
+    ssize_t zero_pid = sched::create_task(-1, NULL, sched::task_idle);
+    sched::create_thread(zero_pid, (size_t)pmm::zero_thread, 0x8, NULL, NULL, NULL);
+
+    ssize_t collapse_pid = sched::create_task(-1, NULL, sched::task_idle);
+    sched::create_thread(collapse_pid, (size_t)mm::collapse_thread, 0x8, NULL, NULL, NULL);
+
     asm ("sti");
 
     for(;;)
@@ -1,127 +1,316 @@
 #include <mm/mmap.hpp>
-#include <mm/slab.hpp>
+#include <mm/page_cache.hpp>
+#include <mm/shm.hpp>
 #include <fs/fd.hpp>
 #include <sched/smp.hpp>
+#include <sched/scheduler.hpp>
+#include <drivers/hpet.hpp>
 
 namespace mm {
 
-static void *mmap_alloc(vmm::pmlx_table *page_map, void *addr, size_t length, int flags) {
-    size_t page_cnt = div_roundup(length, vmm::page_size), offset = 0;
+// reserves [base, base + length), whatever was mapped there before is unmapped and its frames released
+static void vma_reserve(vmm::pmlx_table *page_map, uint64_t base, size_t length, int prot, int flags, vfs::node *file, ssize_t off) {
+    spin_lock(&page_map->vma_lock);
 
-    if(page_map->bitmap == NULL) {
-        page_map->bm_size = 0x1000;
-        page_map->bitmap = (uint8_t*)kmm::calloc(page_map->bm_size); 
-    }
+    page_map->vmas.remove(base, length);
+    page_map->unmap_range(base, length / vmm::page_size, true);
+    page_map->vmas.insert(base, length, prot, flags, file, off);
 
-    auto bm_index = [&](void *address) {
-        return ((size_t)address - mmap_min_addr) / vmm::page_size;
-    };
+    spin_release(&page_map->vma_lock);
 
-    if(flags & map_fixed) {
-        auto index = bm_index(addr);
-        for(size_t i = index; i < index + page_cnt; i++) { 
-            bm_set(page_map->bitmap, i);
-        }
-        return addr;
-    }
+    page_map->shootdown();
+}
 
-    for(size_t i = 0, cnt = 0; i < page_map->bm_size; i++) {
-        if(bm_test(page_map->bitmap, i)) {
-            offset += cnt + 1;
-            cnt = 0;
-        }
+// lowest free range of length bytes, large anonymous regions prefer a 2MiB boundary so their faults can be
+// backed by huge pages. vma_lock must be held
+static uint64_t mmap_alloc(vmm::pmlx_table *page_map, size_t length, int flags) {
+    uint64_t ret = -1;
 
-        if(++cnt == page_cnt) {
-            addr = (void*)(offset * vmm::page_size + mmap_min_addr); 
-            auto index = bm_index(addr); 
+    if((flags & map_anonymous) && length >= huge_length)
+        ret = page_map->vmas.find_gap(length, huge_length, mmap_min_addr, page_map->user_end());
 
-            for(size_t i = index; i < index + page_cnt; i++) {
-                bm_set(page_map->bitmap, i);
-            }
+    if(ret == -1ull)
+        ret = page_map->vmas.find_gap(length, vmm::page_size, mmap_min_addr, page_map->user_end());
 
-            return addr;
+    return ret;
+}
+
+static bool check_mmap_addr(vmm::pmlx_table *page_map, uint64_t base, size_t length) {
+    if(base < mmap_min_addr || base + length > page_map->user_end() || base + length < base)
+        return false;
+
+    vma *next = page_map->vmas.lower_bound(base);
+
+    return next == NULL || next->base >= base + length;
+}
+
+void *mmap(vmm::pmlx_table *page_map, void *addr, size_t length, int prot, int flags, int fd, ssize_t off) {
+    size_t page_cnt = div_roundup(length, vmm::page_size);
+    uint64_t base = reinterpret_cast<uint64_t>(addr) & ~(vmm::page_size - 1);
+
+    if(!(flags & map_anonymous)) {
+        fs::fd &fd_back = fs::fd_list[fd]; 
+        if(fd_back.backing_fd == -1 || fd_back.status == 0) {
+            fs::fd_list.remove(fd); 
+            return (void*)map_failed;
         }
+
+        return mmap_file(page_map, addr, length, prot, flags, fd_back.vfs_node, off);
     }
 
-    page_map->bm_size += 0x1000;
-    page_map->bitmap = (uint8_t*)kmm::recalloc(page_map->bitmap, page_map->bm_size);
+    if(flags & map_shared) {
+        vfs::node *object = shm_create("anonymous", page_cnt * vmm::page_size);
 
-    return mmap_alloc(page_map, addr, length, flags);
-}
+        void *ret = mmap_file(page_map, addr, length, prot, flags & ~map_anonymous, object, 0);
+        shm_unref(object);
 
-static ssize_t check_mmap_addr(vmm::pmlx_table *page_map, void *addr, size_t length, int flags) {
-    if(addr == NULL) 
-        return -1;
+        return ret;
+    }
 
-    if(flags == map_fixed) 
-        return 0;
+    if(flags & map_fixed) {
+        if(base + page_cnt * vmm::page_size > page_map->user_end() || base + page_cnt * vmm::page_size < base)
+            return (void*)map_failed;
 
-    if(page_map->bitmap == NULL) {
-        page_map->bm_size = 0x1000;
-        page_map->bitmap = (uint8_t*)kmm::calloc(page_map->bm_size); 
+        vma_reserve(page_map, base, page_cnt * vmm::page_size, prot, flags, NULL, 0);
+        return (void*)base;
     }
 
-    auto index = [&](void *address) {
-        return ((size_t)address - mmap_min_addr) / vmm::page_size;
-    } (addr);
+    spin_lock(&page_map->vma_lock);
 
-    size_t page_cnt = div_roundup(length, vmm::page_size);
+    if(!check_mmap_addr(page_map, base, page_cnt * vmm::page_size))
+        base = mmap_alloc(page_map, page_cnt * vmm::page_size, flags);
 
-    for(size_t i = index; i < index + page_cnt; i++) {
-        if(bm_test(page_map->bitmap, i)) {
-            return -1;
-        }
+    if(base == -1ull) {
+        spin_release(&page_map->vma_lock);
+        return (void*)map_failed;
     }
 
-    return 0;
+    page_map->vmas.insert(base, page_cnt * vmm::page_size, prot, flags, NULL, 0);
+
+    spin_release(&page_map->vma_lock);
+
+    return (void*)base;
 }
 
-void *mmap(vmm::pmlx_table *page_map, void *addr, size_t length, int prot, int flags, int fd, [[maybe_unused]] ssize_t off) {
+// file mappings only reserve a vma, their faults map frames of the page cache directly
+void *mmap_file(vmm::pmlx_table *page_map, void *addr, size_t length, int prot, int flags, vfs::node *file, ssize_t off) {
     size_t page_cnt = div_roundup(length, vmm::page_size);
+    uint64_t base = reinterpret_cast<uint64_t>(addr) & ~(vmm::page_size - 1);
 
-    if(flags == map_anonymous) {
-        if(check_mmap_addr(page_map, addr, length, flags) == -1) {
-            addr = mmap_alloc(page_map, addr, length, flags);
-        }
+    if(file == NULL || (off & (vmm::page_size - 1)))
+        return (void*)map_failed;
 
-        page_map->map_range((size_t)addr, page_cnt, prot, prot);
-    }
+    spin_lock(&page_map->vma_lock);
 
     if(flags & map_fixed) {
-        page_map->map_range((size_t)addr, page_cnt, prot, prot);
-        mmap_alloc(page_map, addr, length, flags);
-        if(!(flags & map_anonymous)) {
-            fs::fd &fd_back = fs::fd_list[fd]; 
-            if(fd_back.backing_fd != -1 || fd_back.status != 0) {
-                fd_back.read(addr, length);
-            } else {
-                fs::fd_list.remove(fd); 
-            }
-        }
+        page_map->vmas.remove(base, page_cnt * vmm::page_size);
+        page_map->unmap_range(base, page_cnt, true);
+    } else if(!check_mmap_addr(page_map, base, page_cnt * vmm::page_size)) {
+        base = mmap_alloc(page_map, page_cnt * vmm::page_size, flags);
     }
 
-    return addr;
+    if(base == -1ull) {
+        spin_release(&page_map->vma_lock);
+        return (void*)map_failed;
+    }
+
+    page_map->vmas.insert(base, page_cnt * vmm::page_size, prot, flags, file, off);
+
+    spin_release(&page_map->vma_lock);
+
+    page_map->shootdown();
+
+    return (void*)base;
 }
 
 ssize_t munmap(vmm::pmlx_table *page_map, void *addr, size_t length) {
-    size_t index = ((size_t)addr - mmap_min_addr) / vmm::page_size;
+    uint64_t base = reinterpret_cast<uint64_t>(addr) & ~(vmm::page_size - 1);
     size_t page_cnt = div_roundup(length, vmm::page_size);
 
-    if(index >= page_map->bm_size) {
+    if(base >= page_map->user_end()) {
+        return -1;
+    } else if(base + page_cnt * vmm::page_size > page_map->user_end()) {
+        page_cnt = (page_map->user_end() - base) / vmm::page_size;
+    }
+
+    spin_lock(&page_map->vma_lock);
+
+    page_map->vmas.remove(base, page_cnt * vmm::page_size);
+    page_map->unmap_range(base, page_cnt, true);
+
+    spin_release(&page_map->vma_lock);
+
+    page_map->shootdown();
+
+    return 0;
+}
+
+// file pages are mapped straight from the page cache, read-only for shared mappings and copy-on-write for private ones.
+// shared memory objects are mapped the same way except that their shared mappings are writable
+static ssize_t file_fault(vmm::pmlx_table *page_map, vma *region, uint64_t vaddr, uint64_t err_code) {
+    bool shm = is_shm(region->file);
+
+    if((err_code & fault_write) && !(region->flags & map_private) && !shm)
+        return -1;
+
+    uint64_t page = vaddr & ~(vmm::page_size - 1);
+    size_t index = (region->offset + page - region->base) / vmm::page_size;
+
+    size_t paddr = shm ? shm_get(region->file, index) : page_cache_get(region->file, index);
+    if(paddr == -1ull)
         return -1;
-    } else if(index + page_cnt > page_map->bm_size) {
-        page_cnt = page_map->bm_size - index;
+
+    uint64_t flags = region->prot & ~vmm::pte_rw;
+    if((region->flags & map_private) && (region->prot & vmm::pte_rw)) {
+        flags |= vmm::pte_cow;
+    } else if(shm) {
+        flags = region->prot | vmm::pte_shared;
     }
 
-    for(size_t i = index; i < index + page_cnt; i++) {
-        bm_clear(page_map->bitmap, i);
+    // a racing fault that mapped the page first already did the work, a write retries into break_cow
+    ssize_t ret = page_map->map_frame(page, paddr, flags);
+    if(ret != 0) {
+        pmm::page_unref(pmm::phys_to_page(paddr));
+        return ret == 1 ? 0 : -1;
     }
 
-    page_map->unmap_range((size_t)addr, page_cnt);
+    if((err_code & fault_write) && (flags & vmm::pte_cow))
+        return page_map->break_cow(page);
+
+    return 0;
+}
+
+// not-present faults inside an anonymous vma get zeroed frames, along with the rest of their fault_around_pages window,
+// file vmas get their page cache frame and write faults on copy-on-write pages get a private copy. anonymous vmas covering the whole 2MiB range around
+// the fault try a huge page first and fall back to the 4KiB window when no huge frame is available. vma_lock must be held
+static ssize_t handle_fault(vmm::pmlx_table *page_map, uint64_t vaddr, uint64_t err_code) {
+    vma *region = page_map->vmas.find(vaddr);
+    if(region == NULL || !(region->prot & (1 << 0)) || ((err_code & fault_write) && !(region->prot & (1 << 1))))
+        return -1;
+
+    if(!(err_code & fault_present) && page_map->migrating(vaddr))
+        return 0;
+
+    if(err_code & fault_present)
+        return (err_code & fault_write) ? page_map->break_cow(vaddr) : -1;
+
+    if(region->file != NULL)
+        return file_fault(page_map, region, vaddr, err_code);
+
+    uint64_t huge_start = vaddr & ~(huge_length - 1);
+
+    if((region->flags & map_anonymous) && huge_start >= region->base && huge_start + huge_length <= region->base + region->length)
+        page_map->map_range(huge_start, 1, region->prot | vmm::pte_ps, -1);
+
+    uint64_t window = fault_around_pages * vmm::page_size;
+    uint64_t start = vaddr & ~(window - 1);
+    uint64_t end = start + window;
+
+    if(start < region->base)
+        start = region->base;
+    if(end > region->base + region->length)
+        end = region->base + region->length;
+
+    page_map->map_range(start, (end - start) / vmm::page_size, region->prot, -1);
 
     return 0;
 }
 
+// runs with interrupts off, so vma_lock is spun on while acking shootdowns and the one this fault queued waits until it is dropped
+ssize_t page_fault(vmm::pmlx_table *page_map, uint64_t vaddr, uint64_t err_code) {
+    vmm::spin_lock_ack(&page_map->vma_lock);
+    ssize_t ret = handle_fault(page_map, vaddr, err_code);
+    spin_release(&page_map->vma_lock);
+
+    page_map->shootdown();
+
+    return ret;
+}
+
+vmm::pmlx_table *fork(vmm::pmlx_table *page_map) {
+    spin_lock(&page_map->vma_lock);
+
+    vmm::pmlx_table *child = page_map->fork();
+    if(child == NULL) {
+        spin_release(&page_map->vma_lock);
+        return NULL;
+    }
+
+    for(vma *cur = page_map->vmas.first(); cur != NULL; cur = vma_tree::next(cur))
+        child->vmas.insert(cur->base, cur->length, cur->prot, cur->flags, cur->file, cur->offset);
+
+    spin_release(&page_map->vma_lock);
+
+    page_map->shootdown();
+
+    return child;
+}
+
+// releases every vma, frame and user page table of an address space nothing runs on anymore
+void destroy(vmm::pmlx_table *page_map) {
+    spin_lock(&page_map->vma_lock);
+
+    page_map->vmas.clear();
+    page_map->destroy();
+
+    spin_release(&page_map->vma_lock);
+}
+
+// lowest 2MiB aligned range at or above floor that lies inside an anonymous vma, -1 when there is none. vma_lock must be held
+static uint64_t collapse_next(vmm::pmlx_table *page_map, uint64_t floor) {
+    for(vma *cur = page_map->vmas.lower_bound(floor); cur != NULL; cur = vma_tree::next(cur)) {
+        if(!(cur->flags & map_anonymous))
+            continue;
+
+        uint64_t base = align_up(cur->base < floor ? floor : cur->base, huge_length);
+        if(base + huge_length <= cur->end())
+            return base;
+    }
+
+    return -1;
+}
+
+// collapse runs without vma_lock since it waits for tlb shootdowns, it copes with the range changing under it
+static void collapse_scan(vmm::pmlx_table *page_map) {
+    for(uint64_t base = 0;; base += huge_length) {
+        spin_lock(&page_map->vma_lock);
+        base = collapse_next(page_map, base);
+        spin_release(&page_map->vma_lock);
+
+        if(base == -1ull)
+            break;
+
+        page_map->collapse(base);
+    }
+}
+
+// background pass folding fully populated 4KiB ranges of anonymous vmas into huge pages
+void collapse_thread() {
+    for(;;) {
+        ksleep_idle(collapse_interval);
+
+        for(size_t i = 0;; i++) {
+            asm ("cli");
+            spin_lock(&sched::scheduler_lock);
+
+            vmm::pmlx_table *page_map = NULL;
+            bool done = i >= sched::task_list.size();
+
+            if(!done)
+                page_map = sched::task_list[sched::task_list.get_tag(i)].page_map;
+
+            spin_release(&sched::scheduler_lock);
+            asm ("sti");
+
+            if(done)
+                break;
+
+            if(page_map != NULL && page_map != vmm::kernel_mapping)
+                collapse_scan(page_map);
+        }
+    }
+}
+
 extern "C" void syscall_mmap(regs *regs_cur) {
     smp::cpu &cpu = smp::core_local();
     regs_cur->rax = (size_t)mmap(cpu.page_map, (void*)regs_cur->rdi, regs_cur->rsi, (int)regs_cur->rdx | (1 << 2), (int)regs_cur->r10, (int)regs_cur->r8, (ssize_t)regs_cur->r9);
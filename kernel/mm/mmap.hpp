@@ -13,9 +13,22 @@ constexpr ssize_t map_anonymous = 0x8;
 
 constexpr ssize_t mmap_min_addr = 0x10000;
 
+constexpr size_t fault_around_pages = 4;
+
+constexpr size_t huge_length = 0x200000;
+constexpr size_t collapse_interval = 1000;
+
+constexpr uint64_t fault_present = 1 << 0;
+constexpr uint64_t fault_write = 1 << 1;
+constexpr uint64_t fault_user = 1 << 2;
+
 void *mmap(vmm::pmlx_table *page_map, void *addr, size_t length, int prot, int flags, int fd, ssize_t off);
+void *mmap_file(vmm::pmlx_table *page_map, void *addr, size_t length, int prot, int flags, vfs::node *file, ssize_t off);
 ssize_t munmap(vmm::pmlx_table *page_map, void *addr, size_t length);
-void mmap_reserve(vmm::pmlx_table *page_map, void *addr, size_t length);
+ssize_t page_fault(vmm::pmlx_table *page_map, uint64_t vaddr, uint64_t err_code);
+vmm::pmlx_table *fork(vmm::pmlx_table *page_map);
+void destroy(vmm::pmlx_table *page_map);
+void collapse_thread();
 
 }
 
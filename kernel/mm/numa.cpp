@@ -0,0 +1,135 @@
+#include <mm/numa.hpp>
+#include <acpi/srat.hpp>
+
+namespace numa {
+
+static uint32_t domains[max_nodes];
+static size_t domain_cnt = 0;
+
+static size_t domain_node(uint32_t domain) {
+    for(size_t i = 0; i < domain_cnt; i++) {
+        if(domains[i] == domain)
+            return i;
+    }
+
+    if(domain_cnt == max_nodes)
+        return 0;
+
+    domains[domain_cnt] = domain;
+
+    return domain_cnt++;
+}
+
+void init() {
+    srat_ptr = find_SDT<srat>("SRAT");
+    if(srat_ptr == NULL)
+        return;
+
+    size_t length = srat_ptr->acpihdr_ptr.length - (sizeof(srat_ptr->acpihdr_ptr) + sizeof(srat_ptr->reserved0) + sizeof(srat_ptr->reserved1));
+
+    for(size_t i = 0; i < length;) {
+        uint8_t entry_type = srat_ptr->entries[i];
+        uint8_t entry_size = srat_ptr->entries[i + 1];
+        void *entry = &srat_ptr->entries[i + 2];
+
+        if(entry_size < 2)
+            break;
+
+        switch(entry_type) {
+            case 0: {
+                srat0 *affinity = reinterpret_cast<srat0*>(entry);
+                if(!(affinity->flags & 1) || cpu_cnt == max_cpus)
+                    break;
+
+                uint32_t domain = affinity->domain_low | affinity->domain_high[0] << 8 | affinity->domain_high[1] << 16 | affinity->domain_high[2] << 24;
+                cpus[cpu_cnt++] = { affinity->apic_id, domain_node(domain) };
+                break;
+            }
+            case 1: {
+                srat1 *affinity = reinterpret_cast<srat1*>(entry);
+                if(!(affinity->flags & 1) || range_cnt == max_ranges)
+                    break;
+
+                ranges[range_cnt++] = { affinity->base, affinity->length, domain_node(affinity->domain) };
+                break;
+            }
+            case 2: {
+                srat2 *affinity = reinterpret_cast<srat2*>(entry);
+                if(!(affinity->flags & 1) || cpu_cnt == max_cpus)
+                    break;
+
+                cpus[cpu_cnt++] = { affinity->x2apic_id, domain_node(affinity->domain) };
+            }
+        }
+
+        i += entry_size;
+    }
+
+    node_cnt = domain_cnt ? domain_cnt : 1;
+
+    slit_ptr = find_SDT<slit>("SLIT");
+
+    for(size_t i = 0; i < node_cnt; i++) {
+        size_t cnt = 0;
+
+        for(size_t j = 0; j < node_cnt; j++) {
+            size_t k = cnt++;
+            while(k && distance(i, fallback[i][k - 1]) > distance(i, j)) {
+                fallback[i][k] = fallback[i][k - 1];
+                k--;
+            }
+            fallback[i][k] = j;
+        }
+    }
+
+    print("[NUMA] {} nodes, {} memory ranges, {} cpus\n", node_cnt, range_cnt, cpu_cnt);
+}
+
+size_t addr_node(size_t addr) {
+    for(size_t i = 0; i < range_cnt; i++) {
+        if(addr >= ranges[i].base && addr < ranges[i].base + ranges[i].length)
+            return ranges[i].node;
+    }
+
+    return 0;
+}
+
+size_t next_boundary(size_t addr) {
+    size_t ret = -1;
+
+    for(size_t i = 0; i < range_cnt; i++) {
+        size_t base = ranges[i].base;
+        size_t end = ranges[i].base + ranges[i].length;
+
+        if(base > addr && base < ret)
+            ret = base;
+        if(end > addr && end < ret)
+            ret = end;
+    }
+
+    return ret;
+}
+
+size_t apic_node(uint32_t apic_id) {
+    for(size_t i = 0; i < cpu_cnt; i++) {
+        if(cpus[i].apic_id == apic_id)
+            return cpus[i].node;
+    }
+
+    return 0;
+}
+
+size_t distance(size_t from, size_t to) {
+    if(slit_ptr == NULL || from >= domain_cnt || to >= domain_cnt) 
+        return from == to ? local_distance : remote_distance;
+
+    uint32_t from_domain = domains[from];
+    uint32_t to_domain = domains[to];
+
+    if(from_domain >= slit_ptr->locality_cnt || to_domain >= slit_ptr->locality_cnt)
+        return from == to ? local_distance : remote_distance;
+
+    return slit_ptr->entries[from_domain * slit_ptr->locality_cnt + to_domain];
+}
+
+}
@@ -0,0 +1,43 @@
+#ifndef NUMA_HPP_
+#define NUMA_HPP_
+
+#include <types.hpp>
+
+namespace numa {
+
+constexpr size_t max_nodes = 16;
+constexpr size_t max_ranges = 64;
+constexpr size_t max_cpus = 256;
+
+constexpr size_t local_distance = 10;
+constexpr size_t remote_distance = 20;
+
+struct mem_range {
+    size_t base;
+    size_t length;
+    size_t node;
+};
+
+struct cpu_affinity {
+    uint32_t apic_id;
+    size_t node;
+};
+
+inline size_t node_cnt = 1;
+inline size_t range_cnt = 0;
+inline size_t cpu_cnt = 0;
+
+inline mem_range ranges[max_ranges];
+inline cpu_affinity cpus[max_cpus];
+inline size_t fallback[max_nodes][max_nodes];
+
+void init();
+
+size_t addr_node(size_t addr);
+size_t next_boundary(size_t addr);
+size_t apic_node(uint32_t apic_id);
+size_t distance(size_t from, size_t to);
+
+}
+
+#endif
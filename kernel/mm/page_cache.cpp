@@ -0,0 +1,183 @@
+#include <mm/page_cache.hpp>
+#include <mm/slab.hpp>
+#include <fs/vfs.hpp>
+
+namespace mm {
+
+static kmm::object_cache<cache_entry> entry_cache("page_cache_entry");
+
+static cache_entry *buckets[page_cache_buckets];
+static size_t cache_lock = 0;
+
+static pmm::lru_list cache_lru = { pmm::lru_end, pmm::lru_end, 0, 0 };
+
+static size_t bucket(vfs::node *file, size_t index) {
+    return (reinterpret_cast<size_t>(file) / sizeof(vfs::node) + index) % page_cache_buckets;
+}
+
+static cache_entry *lookup(vfs::node *file, size_t index) {
+    for(cache_entry *entry = buckets[bucket(file, index)]; entry != NULL; entry = entry->next) {
+        if(entry->file == file && entry->index == index)
+            return entry;
+    }
+
+    return NULL;
+}
+
+// drops the cache's reference, the frame lives on while it is still mapped somewhere. cache_lock must be held
+static void unlink(cache_entry *entry) {
+    cache_entry **slot = &buckets[bucket(entry->file, entry->index)];
+
+    while(*slot != entry)
+        slot = &(*slot)->next;
+
+    *slot = entry->next;
+
+    pmm::page_unref(pmm::phys_to_page(entry->paddr));
+    entry_cache.free(entry);
+}
+
+// frame caching page index of file, filled from the filesystem on a miss. the caller gets its own reference,
+// -1 is returned past the end of the file or when the read fails
+size_t page_cache_get(vfs::node *file, size_t index) {
+    spin_lock(&cache_lock);
+
+    cache_entry *entry = lookup(file, index);
+    if(entry != NULL) {
+        pmm::page *pg = pmm::phys_to_page(entry->paddr);
+        size_t paddr = entry->paddr;
+
+        pmm::page_ref(pg);
+        pmm::lru_remove(&cache_lru, pg);
+        pmm::lru_push(&cache_lru, pg);
+
+        spin_release(&cache_lock);
+
+        return paddr;
+    }
+
+    spin_release(&cache_lock);
+
+    size_t off = index * vmm::page_size;
+    if(off >= static_cast<size_t>(file->stat_cur->st_size))
+        return -1;
+
+    size_t cnt = file->stat_cur->st_size - off;
+    if(cnt > vmm::page_size)
+        cnt = vmm::page_size;
+
+    size_t paddr = pmm::calloc(1);
+    if(paddr == -1ull)
+        return -1;
+
+    if(file->filesystem->read(file, off, cnt, reinterpret_cast<void*>(paddr + vmm::high_vma)) == -1) {
+        pmm::free(paddr, 1);
+        return -1;
+    }
+
+    cache_entry *new_entry = entry_cache.alloc();
+
+    spin_lock(&cache_lock);
+
+    entry = lookup(file, index);
+    if(entry != NULL) {
+        size_t cached = entry->paddr;
+        pmm::page_ref(pmm::phys_to_page(cached));
+
+        spin_release(&cache_lock);
+
+        entry_cache.free(new_entry);
+        pmm::free(paddr, 1);
+
+        return cached;
+    }
+
+    new_entry->file = file;
+    new_entry->index = index;
+    new_entry->paddr = paddr;
+    new_entry->next = buckets[bucket(file, index)];
+    buckets[bucket(file, index)] = new_entry;
+
+    pmm::page *pg = pmm::phys_to_page(paddr);
+
+    pg->flags |= pmm::page_pagecache;
+    pg->owner = file;
+    pg->index = index;
+
+    pmm::page_ref(pg);
+    pmm::lru_push(&cache_lru, pg);
+
+    spin_release(&cache_lock);
+
+    return paddr;
+}
+
+// keeps cached pages coherent with a write that already reached the filesystem
+void page_cache_write(vfs::node *file, size_t off, const void *buf, size_t cnt) {
+    const uint8_t *src = reinterpret_cast<const uint8_t*>(buf);
+
+    spin_lock(&cache_lock);
+
+    for(size_t end = off + cnt; off < end;) {
+        size_t page_off = off & (vmm::page_size - 1);
+        size_t chunk = vmm::page_size - page_off;
+        if(chunk > end - off)
+            chunk = end - off;
+
+        cache_entry *entry = lookup(file, off / vmm::page_size);
+        if(entry != NULL)
+            memcpy8(reinterpret_cast<uint8_t*>(entry->paddr + page_off + vmm::high_vma), const_cast<uint8_t*>(src), chunk);
+
+        src += chunk;
+        off += chunk;
+    }
+
+    spin_release(&cache_lock);
+}
+
+// forgets every page of a file that is going away, mappings keep their own references
+void page_cache_evict(vfs::node *file) {
+    spin_lock(&cache_lock);
+
+    for(size_t i = 0; i < page_cache_buckets; i++) {
+        for(cache_entry *entry = buckets[i], *next; entry != NULL; entry = next) {
+            next = entry->next;
+
+            if(entry->file != file)
+                continue;
+
+            pmm::lru_remove(&cache_lru, pmm::phys_to_page(entry->paddr));
+            unlink(entry);
+        }
+    }
+
+    spin_release(&cache_lock);
+}
+
+// pmm shrinker, releases cached pages that nothing maps anymore, least recently used first
+size_t page_cache_shrink() {
+    if(!spin_trylock(&cache_lock))
+        return 0;
+
+    size_t ret = 0;
+
+    for(size_t cnt = cache_lru.cnt; cnt > 0; cnt--) {
+        pmm::page *pg = pmm::lru_pop(&cache_lru);
+        if(pg == NULL)
+            break;
+
+        if(__atomic_load_n(&pg->refcnt, __ATOMIC_ACQUIRE) != 1) {
+            pmm::lru_push(&cache_lru, pg);
+            continue;
+        }
+
+        unlink(lookup(reinterpret_cast<vfs::node*>(pg->owner), pg->index));
+        ret++;
+    }
+
+    spin_release(&cache_lock);
+
+    return ret;
+}
+
+}
@@ -0,0 +1,31 @@
+#ifndef PAGE_CACHE_HPP_
+#define PAGE_CACHE_HPP_
+
+#include <mm/pmm.hpp>
+
+namespace vfs {
+
+class node;
+
+}
+
+namespace mm {
+
+constexpr size_t page_cache_buckets = 1024;
+
+struct cache_entry {
+    vfs::node *file;
+    size_t index;
+    size_t paddr;
+
+    cache_entry *next;
+};
+
+size_t page_cache_get(vfs::node *file, size_t index);
+void page_cache_write(vfs::node *file, size_t off, const void *buf, size_t cnt);
+void page_cache_evict(vfs::node *file);
+size_t page_cache_shrink();
+
+}
+
+#endif
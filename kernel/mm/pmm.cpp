@@ -1,20 +1,50 @@
 #include <mm/pmm.hpp>
+#include <mm/numa.hpp>
+#include <sched/smp.hpp>
+#include <drivers/hpet.hpp>
 #include <debug.hpp>
 
 namespace pmm {
 
+constexpr size_t max_order = 18; // 4KiB << 18 = 1GiB
+constexpr uint32_t npos = 0xffffffff;
+
+constexpr uint8_t frame_movable = (1 << 0);
+constexpr uint8_t frame_isolated = (1 << 1);
+constexpr uint8_t frame_pinned = (1 << 2); // stopped being movable while isolated but is still referenced
+
+constexpr size_t max_huge_reserve = 64;
+constexpr size_t max_giant_reserve = 16;
+
+struct frame {
+    uint32_t next;
+    uint32_t last;
+    uint8_t order;
+    uint8_t free;
+    uint8_t flags;
+    uint64_t *rmap;
+};
+
 class mem_chunk {
 public:
-    mem_chunk(size_t base, size_t page_cnt);
+    mem_chunk(size_t base, size_t page_cnt, size_t numa_node);
     mem_chunk() = default;
 
     mem_chunk *append_chunk(mem_chunk &&chunk);
 
     size_t alloc(size_t cnt, size_t align);
+    size_t alloc_batch(size_t *frames, size_t cnt);
     void free(size_t base, size_t cnt);
 
+    void set_movable(size_t base, uint64_t *pte);
+    void clear_movable(size_t base);
+    bool drop_movable(size_t base);
+    size_t compact(size_t order);
+
     size_t base;
     size_t page_cnt;
+    size_t free_cnt;
+    size_t numa_node;
 
     mem_chunk *next;
     mem_chunk *last;
@@ -22,13 +52,66 @@ public:
     static size_t buffer;
     static void *chunk_alloc(size_t cnt);
 private:
-    size_t bitmap_size;
-    size_t bitmap_cnt;
-    uint8_t *bitmap;
+    void push_block(size_t index, size_t order);
+    void pop_block(size_t index);
+    void free_block(size_t index, size_t order);
+    void free_range(size_t index, size_t cnt);
+
+    bool isolate(size_t index, size_t order);
+    bool freeze(size_t index);
+    void thaw(size_t index);
+    bool migrate(size_t index);
+    void release(size_t index, size_t order);
+
+    size_t pfn(size_t index) { return base / vmm::page_size + index; }
+
+    frame *frames;
+    uint32_t free_list[max_order + 1];
+    size_t lock;
 };
 
 static mem_chunk *root = NULL;
-static size_t pmm_lock = 0;
+
+struct zero_pool {
+    size_t frames[zero_pool_size];
+    size_t cnt;
+    size_t lock;
+};
+
+static zero_pool zero_pools[numa::max_nodes];
+
+static size_t huge_reserve[max_huge_reserve];
+static size_t huge_reserve_cnt = 0;
+static size_t huge_reserve_target = 0;
+
+static size_t giant_reserve[max_giant_reserve];
+static size_t giant_reserve_cnt = 0;
+static size_t giant_reserve_target = 0;
+
+static size_t (*shrinkers[max_shrinkers])();
+static size_t shrinker_cnt = 0;
+static size_t shrinker_lock = 0;
+
+static size_t reserve_lock = 0;
+static size_t compact_lock = 0;
+
+static size_t buddy_alloc(size_t cnt, size_t align, size_t numa_node);
+static void buddy_free(size_t base, size_t cnt);
+
+static size_t cmdline_value(const char *cmdline, const char *key) {
+    size_t key_length = strlen(key);
+
+    for(const char *str = cmdline; str && *str; str++) {
+        if((str == cmdline || str[-1] == ' ') && strncmp(str, key, key_length) == 0 && str[key_length] == '=') {
+            size_t ret = 0;
+            for(str += key_length + 1; *str >= '0' && *str <= '9'; str++)
+                ret = ret * 10 + (*str - '0');
+            return ret;
+        }
+    }
+
+    return 0;
+}
 
 size_t mem_chunk::buffer = 0;
 
@@ -38,12 +121,15 @@ void init(stivale *stivale) {
     auto max_size = [&]() {
         size_t buffer_size = 0;
         for(size_t i = 0; i < stivale->mmap_cnt; i++) {
-            if(mmap[i].type == 1)
-                buffer_size += sizeof(mem_chunk) + (mmap[i].len / vmm::page_size / 8);
+            if(mmap[i].type == 1) {
+                buffer_size += sizeof(mem_chunk) + (mmap[i].len / vmm::page_size) * sizeof(frame);
+                if((mmap[i].addr + mmap[i].len) / vmm::page_size > max_pfn)
+                    max_pfn = (mmap[i].addr + mmap[i].len) / vmm::page_size;
+            }
             total_mem += mmap[i].len;
         }
 
-        return buffer_size; 
+        return buffer_size + numa::range_cnt * sizeof(mem_chunk) + max_pfn * sizeof(page);
     }();
 
     for(size_t i = 0; i < stivale->mmap_cnt; i++) {
@@ -58,24 +144,70 @@ void init(stivale *stivale) {
             mem_chunk::buffer = mmap[i].addr + vmm::high_vma;
             mmap[i].addr += max_size;
             mmap[i].len -= max_size;
-            break; 
+            break;
         }
     }
 
+    pages = reinterpret_cast<page*>(mem_chunk::chunk_alloc(max_pfn * sizeof(page)));
+
+    for(size_t pfn = 0; pfn < max_pfn; pfn++)
+        pages[pfn] = { 0, 0, NULL, lru_end, lru_end, 0 };
+
     for(; i < stivale->mmap_cnt; i++) {
         if(mmap[i].type == 1 && mmap[i].len) {
             size_t save = mmap[i].addr;
             mmap[i].addr = align_up(mmap[i].addr, vmm::page_size);
             mmap[i].len -= mmap[i].addr - save;
 
-            if(root) {
-                root->append_chunk(mem_chunk(mmap[i].addr, mmap[i].len / vmm::page_size));
-            } else {
-                root = (mem_chunk*)mem_chunk::chunk_alloc(sizeof(mem_chunk));
-                *root = mem_chunk(mmap[i].addr, mmap[i].len / vmm::page_size);
+            size_t base = mmap[i].addr;
+            size_t end = mmap[i].addr + mmap[i].len;
+
+            while(base < end) {
+                size_t limit = numa::next_boundary(base);
+                if(limit > end)
+                    limit = end;
+
+                size_t page_cnt = (limit - base) / vmm::page_size;
+                size_t numa_node = numa::addr_node(base);
+
+                if(page_cnt && root) {
+                    root->append_chunk(mem_chunk(base, page_cnt, numa_node));
+                } else if(page_cnt) {
+                    root = (mem_chunk*)mem_chunk::chunk_alloc(sizeof(mem_chunk));
+                    *root = mem_chunk(base, page_cnt, numa_node);
+                }
+
+                base = align_up(limit, vmm::page_size);
             }
         }
     }
+
+    const char *cmdline = stivale->cmdline ? reinterpret_cast<const char*>(reinterpret_cast<size_t>(stivale->cmdline) + vmm::high_vma) : NULL;
+
+    huge_reserve_target = cmdline_value(cmdline, "hugepages");
+    giant_reserve_target = cmdline_value(cmdline, "hugepages_1g");
+
+    if(huge_reserve_target > max_huge_reserve)
+        huge_reserve_target = max_huge_reserve;
+    if(giant_reserve_target > max_giant_reserve)
+        giant_reserve_target = max_giant_reserve;
+
+    while(giant_reserve_cnt < giant_reserve_target) {
+        size_t page = buddy_alloc(giant_page_cnt, giant_page_cnt, 0);
+        if(page == -1ull)
+            break;
+        giant_reserve[giant_reserve_cnt++] = page;
+    }
+
+    while(huge_reserve_cnt < huge_reserve_target) {
+        size_t page = buddy_alloc(huge_page_cnt, huge_page_cnt, 0);
+        if(page == -1ull)
+            break;
+        huge_reserve[huge_reserve_cnt++] = page;
+    }
+
+    if(huge_reserve_target || giant_reserve_target)
+        print("PMM: reserved {} 2MiB and {} 1GiB frames\n", huge_reserve_cnt, giant_reserve_cnt);
 }
 
 mem_chunk *mem_chunk::append_chunk(mem_chunk &&chunk) {
@@ -86,50 +218,414 @@ mem_chunk *mem_chunk::append_chunk(mem_chunk &&chunk) {
     node->next = reinterpret_cast<mem_chunk*>(buffer);
     buffer += sizeof(mem_chunk);
     *node->next = chunk;
+    node->next->last = node;
 
     return node->next;
 }
 
-mem_chunk::mem_chunk(size_t base, size_t page_cnt) : base(base), page_cnt(page_cnt) {
-    bitmap_size = div_roundup(page_cnt, 8);
-    bitmap = (uint8_t*)chunk_alloc(bitmap_size);
-    memset8(bitmap, 0, bitmap_size);
+mem_chunk::mem_chunk(size_t base, size_t page_cnt, size_t numa_node) : base(base), page_cnt(page_cnt), free_cnt(0), numa_node(numa_node), next(NULL), last(NULL), lock(0) {
+    frames = (frame*)chunk_alloc(page_cnt * sizeof(frame));
+
+    for(size_t i = 0; i < page_cnt; i++)
+        frames[i] = { npos, npos, 0, 0, 0, NULL };
+
+    for(size_t i = 0; i <= max_order; i++)
+        free_list[i] = npos;
+
+    for(size_t i = 0; i < page_cnt;) {
+        size_t order = max_order;
+        while(order && ((pfn(i) & ((1ull << order) - 1)) || i + (1ull << order) > page_cnt))
+            order--;
+
+        push_block(i, order);
+        free_cnt += 1ull << order;
+        i += 1ull << order;
+    }
+}
+
+void mem_chunk::push_block(size_t index, size_t order) {
+    frame &block = frames[index];
+
+    block.order = order;
+    block.free = 1;
+    block.last = npos;
+    block.next = free_list[order];
+
+    if(free_list[order] != npos)
+        frames[free_list[order]].last = index;
+
+    free_list[order] = index;
+}
+
+void mem_chunk::pop_block(size_t index) {
+    frame &block = frames[index];
+
+    if(block.next != npos)
+        frames[block.next].last = block.last;
+
+    if(block.last != npos) {
+        frames[block.last].next = block.next;
+    } else {
+        free_list[block.order] = block.next;
+    }
+
+    block.free = 0;
+    block.next = npos;
+    block.last = npos;
+}
+
+void mem_chunk::free_block(size_t index, size_t order) {
+    while(order < max_order) {
+        size_t buddy = (pfn(index) ^ (1ull << order)) - pfn(0);
+
+        if(buddy >= page_cnt || !frames[buddy].free || frames[buddy].order != order)
+            break;
+
+        pop_block(buddy);
+
+        if(buddy < index)
+            index = buddy;
+        order++;
+    }
+
+    push_block(index, order);
+}
+
+void mem_chunk::free_range(size_t index, size_t cnt) {
+    while(cnt) {
+        size_t order = pfn(index) ? __builtin_ctzll(pfn(index)) : max_order;
+        if(order > max_order)
+            order = max_order;
+
+        while((1ull << order) > cnt)
+            order--;
+
+        free_block(index, order);
+
+        index += 1ull << order;
+        cnt -= 1ull << order;
+    }
 }
 
 size_t mem_chunk::alloc(size_t cnt, size_t align) {
-    spin_lock(&pmm_lock);
+    size_t order = log2(pow2_roundup(cnt));
+    size_t align_order = log2(pow2_roundup(align));
 
-    size_t alloc_base = align_up(base, align * vmm::page_size);
-    size_t bit_base = (alloc_base - base) / vmm::page_size;
+    if(align_order > order)
+        order = align_order;
 
-    for(size_t i = bit_base; i < page_cnt; i += align) {
-        for(size_t j = i, count = 0; j < i + cnt; j++) {
-            if(bm_test(bitmap, j)) {
-                alloc_base += align * vmm::page_size;
-                break;
-            }
+    if(order > max_order || free_cnt < cnt)
+        return -1;
 
-            if(++count == cnt) {
-                for(size_t z = 0; z < count; z++)
-                    bm_set(bitmap, i + z);
-                spin_release(&pmm_lock);
-                total_used_mem += cnt * vmm::page_size;
-                return alloc_base;
-            }
+    spin_lock(&lock);
+
+    size_t cur = order;
+    while(cur <= max_order && free_list[cur] == npos)
+        cur++;
+
+    if(cur > max_order) {
+        spin_release(&lock);
+        return -1;
+    }
+
+    size_t index = free_list[cur];
+    pop_block(index);
+
+    while(cur > order) {
+        cur--;
+        push_block(index + (1ull << cur), cur);
+    }
+
+    free_range(index + cnt, (1ull << order) - cnt);
+
+    free_cnt -= cnt;
+
+    spin_release(&lock);
+
+    return base + index * vmm::page_size;
+}
+
+size_t mem_chunk::alloc_batch(size_t *frames, size_t cnt) {
+    if(!free_cnt)
+        return 0;
+
+    spin_lock(&lock);
+
+    size_t ret = 0;
+
+    while(ret < cnt) {
+        size_t order = 0;
+        while(order <= max_order && free_list[order] == npos)
+            order++;
+
+        if(order > max_order)
+            break;
+
+        size_t index = free_list[order];
+        pop_block(index);
+
+        while(order > 0) {
+            order--;
+            push_block(index + (1ull << order), order);
         }
+
+        frames[ret++] = base + index * vmm::page_size;
+        free_cnt--;
     }
 
-    spin_release(&pmm_lock);
-    return -1;
+    spin_release(&lock);
+
+    return ret;
 }
 
 void mem_chunk::free(size_t base, size_t cnt) {
-    spin_lock(&pmm_lock);
-    for(size_t i = div_roundup(base, vmm::page_size); i < div_roundup(base, vmm::page_size) + cnt; i++) {
-        total_used_mem -= vmm::page_size;
-        bm_clear(bitmap, i);
+    size_t index = base / vmm::page_size;
+
+    spin_lock(&lock);
+
+    if(frames[index].free) {
+        print("PMM: double free of {x}\n", this->base + base);
+        spin_release(&lock);
+        return;
     }
-    spin_release(&pmm_lock);
+
+    if(cnt == 1 && frames[index].flags & frame_isolated) {
+        frames[index].flags = frame_isolated;
+        spin_release(&lock);
+        return;
+    }
+
+    if(cnt == 1)
+        frames[index].flags = 0;
+
+    free_range(index, cnt);
+    free_cnt += cnt;
+
+    spin_release(&lock);
+}
+
+void mem_chunk::set_movable(size_t base, uint64_t *pte) {
+    size_t index = base / vmm::page_size;
+
+    spin_lock(&lock);
+
+    frames[index].flags = frame_movable;
+    frames[index].rmap = pte;
+
+    spin_release(&lock);
+}
+
+// the frame stays in use but may not move anymore, an isolated one makes its compaction give up
+void mem_chunk::clear_movable(size_t base) {
+    size_t index = base / vmm::page_size;
+
+    spin_lock(&lock);
+
+    if(frames[index].flags & frame_isolated) {
+        frames[index].flags = frame_isolated | frame_pinned;
+    } else {
+        frames[index].flags = 0;
+    }
+
+    frames[index].rmap = NULL;
+
+    spin_release(&lock);
+}
+
+// the frame is being freed. an isolated one is left to its compaction, which takes it as part of the block or frees
+// it when the block is put back, and true is returned
+bool mem_chunk::drop_movable(size_t base) {
+    size_t index = base / vmm::page_size;
+
+    spin_lock(&lock);
+
+    bool isolated = frames[index].flags & frame_isolated;
+    frames[index].flags = isolated ? frame_isolated : 0;
+    frames[index].rmap = NULL;
+
+    spin_release(&lock);
+
+    return isolated;
+}
+
+bool mem_chunk::isolate(size_t index, size_t order) {
+    size_t end = index + (1ull << order);
+
+    for(size_t i = index; i < end;) {
+        if(frames[i].free) {
+            i += 1ull << frames[i].order;
+        } else if(frames[i].flags == frame_movable) {
+            i++;
+        } else {
+            return false;
+        }
+    }
+
+    for(size_t i = index; i < end;) {
+        if(frames[i].free) {
+            size_t block = 1ull << frames[i].order;
+            pop_block(i);
+            free_cnt -= block;
+            i += block;
+        } else {
+            frames[i++].flags |= frame_isolated;
+        }
+    }
+
+    return true;
+}
+
+// takes the pte of a movable frame out of reach before it is copied, accesses fault and retry until migrate
+// installs the copy. the caller shoots down every frozen pte of the block at once
+bool mem_chunk::freeze(size_t index) {
+    size_t src = base + index * vmm::page_size;
+
+    spin_lock(&lock);
+
+    if(!(frames[index].flags & frame_movable)) {
+        bool pinned = frames[index].flags & frame_pinned;
+        spin_release(&lock);
+        return !pinned;
+    }
+
+    uint64_t *pte = frames[index].rmap;
+    uint64_t entry = *pte;
+
+    bool ret = (entry & vmm::pte_addr_mask) == src && vmm::pte_is_present(entry) &&
+        __atomic_compare_exchange_n(pte, &entry, (entry & ~vmm::pte_present) | vmm::pte_migrating, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+
+    spin_release(&lock);
+
+    return ret;
+}
+
+// puts back a pte that freeze took away when the block is given up
+void mem_chunk::thaw(size_t index) {
+    size_t src = base + index * vmm::page_size;
+
+    spin_lock(&lock);
+
+    if(frames[index].flags & frame_movable) {
+        uint64_t *pte = frames[index].rmap;
+        uint64_t entry = *pte;
+
+        if((entry & vmm::pte_addr_mask) == src && (entry & vmm::pte_migrating))
+            __atomic_compare_exchange_n(pte, &entry, (entry & ~vmm::pte_migrating) | vmm::pte_present, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    }
+
+    spin_release(&lock);
+}
+
+// copies a frozen frame and points its pte at the copy, no tlb can hold the old translation anymore
+bool mem_chunk::migrate(size_t index) {
+    size_t numa_node = this->numa_node;
+    size_t dest = buddy_alloc(1, 1, numa_node);
+    if(dest == -1ull)
+        return false;
+
+    size_t src = base + index * vmm::page_size;
+
+    spin_lock(&lock);
+
+    if(!(frames[index].flags & frame_movable)) {
+        bool pinned = frames[index].flags & frame_pinned;
+        spin_release(&lock);
+        buddy_free(dest, 1);
+        return !pinned;
+    }
+
+    uint64_t *pte = frames[index].rmap;
+    uint64_t entry = *pte;
+
+    if((entry & vmm::pte_addr_mask) != src || !(entry & vmm::pte_migrating)) {
+        spin_release(&lock);
+        buddy_free(dest, 1);
+        return false;
+    }
+
+    memcpy64(reinterpret_cast<uint64_t*>(dest + vmm::high_vma), reinterpret_cast<uint64_t*>(src + vmm::high_vma), vmm::page_size / 8);
+
+    uint64_t copy = (entry & ~(vmm::pte_addr_mask | vmm::pte_migrating)) | dest | vmm::pte_present;
+
+    if(!__atomic_compare_exchange_n(pte, &entry, copy, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        spin_release(&lock);
+        buddy_free(dest, 1);
+        return false;
+    }
+
+    frames[index].flags = 0;
+    frames[index].rmap = NULL;
+
+    spin_release(&lock);
+
+    page *src_page = phys_to_page(src), *dest_page = phys_to_page(dest);
+    if(src_page && dest_page) {
+        *dest_page = *src_page;
+        *src_page = { 0, 0, NULL, lru_end, lru_end, 0 };
+    }
+
+    pmm::set_movable(dest, pte);
+
+    return true;
+}
+
+void mem_chunk::release(size_t index, size_t order) {
+    spin_lock(&lock);
+
+    for(size_t i = index; i < index + (1ull << order); i++) {
+        if(frames[i].flags & frame_movable) {
+            frames[i].flags &= ~frame_isolated;
+        } else if(frames[i].flags & frame_pinned) {
+            frames[i].flags = 0;
+        } else {
+            frames[i].flags = 0;
+            free_block(i, 0);
+            free_cnt++;
+        }
+    }
+
+    spin_release(&lock);
+}
+
+size_t mem_chunk::compact(size_t order) {
+    size_t block = 1ull << order;
+
+    for(size_t index = align_up(pfn(0), block) - pfn(0); index + block <= page_cnt; index += block) {
+        spin_lock(&lock);
+        bool isolated = isolate(index, order);
+        spin_release(&lock);
+
+        if(!isolated)
+            continue;
+
+        size_t frozen = index;
+        bool migrated = true;
+
+        for(; frozen < index + block && migrated; frozen++) {
+            if(frames[frozen].flags & frame_isolated)
+                migrated = freeze(frozen);
+        }
+
+        if(migrated)
+            vmm::tlb_shootdown(NULL, 0, -1);
+
+        for(size_t i = index; i < index + block && migrated; i++) {
+            if(frames[i].flags & frame_isolated)
+                migrated = migrate(i);
+        }
+
+        if(migrated)
+            return base + index * vmm::page_size;
+
+        for(size_t i = index; i < frozen; i++) {
+            if(frames[i].flags & frame_isolated)
+                thaw(i);
+        }
+
+        release(index, order);
+    }
+
+    return -1;
 }
 
 void *mem_chunk::chunk_alloc(size_t cnt) {
@@ -138,35 +634,561 @@ void *mem_chunk::chunk_alloc(size_t cnt) {
     return ret;
 }
 
-size_t alloc(size_t cnt, size_t align) {
+static size_t local_node() {
+    if(!smp::percpu_online)
+        return 0;
+    return smp::core_local().numa_node;
+}
+
+static size_t buddy_alloc(size_t cnt, size_t align, size_t numa_node) {
+    for(size_t i = 0; i < numa::node_cnt; i++) {
+        size_t target = numa::fallback[numa_node][i];
+
+        for(mem_chunk *chunk = root; chunk != NULL; chunk = chunk->next) {
+            if(chunk->numa_node != target)
+                continue;
+
+            size_t alloc = chunk->alloc(cnt, align);
+            if(alloc != -1ull)
+                return alloc;
+        }
+    }
+
+    return -1;
+}
+
+static void buddy_free(size_t base, size_t cnt) {
     mem_chunk *chunk = root;
     do {
-        size_t alloc = chunk->alloc(cnt, align);
-        if(alloc == -1ull)
-            chunk = chunk->next;
-        else
-            return alloc;
+        if(base >= chunk->base && (base + cnt * vmm::page_size) <= (chunk->base + chunk->page_cnt * vmm::page_size)) {
+            return chunk->free(base - chunk->base, cnt);
+        }
+        chunk = chunk->next;
     } while(chunk != NULL);
+}
 
-    print("PMM: out of memory\n");
+static mem_chunk *find_chunk(size_t base) {
+    for(mem_chunk *chunk = root; chunk != NULL; chunk = chunk->next) {
+        if(base >= chunk->base && base < chunk->base + chunk->page_cnt * vmm::page_size)
+            return chunk;
+    }
 
-    return -1;
+    return NULL;
 }
 
-size_t calloc(size_t cnt, size_t align) {
-    size_t allocation = alloc(cnt, align);
+static void page_setup(size_t base, [[maybe_unused]] size_t cnt, uint32_t flags, [[maybe_unused]] uint64_t site) {
+    page *pg = phys_to_page(base);
+    if(pg == NULL)
+        return;
+
+    pg->refcnt = 1;
+    pg->flags = flags;
+    pg->owner = NULL;
+    pg->index = 0;
+
+#ifdef ALLOC_PROFILE
+    pg->alloc_site = site;
+    pg->alloc_time = rdtsc();
+    profile::record_alloc(site, cnt * vmm::page_size);
+#endif
+}
+
+static void page_reset(size_t base, [[maybe_unused]] size_t cnt) {
+    page *pg = phys_to_page(base);
+    if(pg == NULL)
+        return;
+
+    pg->refcnt = 0;
+    pg->flags = 0;
+    pg->owner = NULL;
+    pg->index = 0;
+
+#ifdef ALLOC_PROFILE
+    profile::record_free(pg->alloc_site, cnt * vmm::page_size, rdtsc() - pg->alloc_time);
+    pg->alloc_site = 0;
+#endif
+}
+
+static size_t cache_alloc() {
+    size_t rflags = irq_save();
+
+    smp::cpu &cpu = smp::core_local();
+    frame_cache &cache = cpu.frame_cache;
+
+    if(cache.cnt) {
+        cache.hits++;
+    } else {
+        cache.misses++;
+
+        for(size_t i = 0; i < numa::node_cnt && cache.cnt < frame_cache_batch; i++) {
+            size_t target = numa::fallback[cpu.numa_node][i];
+
+            for(mem_chunk *chunk = root; chunk != NULL && cache.cnt < frame_cache_batch; chunk = chunk->next) {
+                if(chunk->numa_node == target)
+                    cache.cnt += chunk->alloc_batch(cache.frames + cache.cnt, frame_cache_batch - cache.cnt);
+            }
+        }
+    }
+
+    size_t ret = cache.cnt ? cache.frames[--cache.cnt] : -1;
+
+    irq_restore(rflags);
+
+    return ret;
+}
+
+static void cache_free(size_t base) {
+    size_t rflags = irq_save();
+
+    frame_cache &cache = smp::core_local().frame_cache;
+
+    if(cache.cnt == frame_cache_size) {
+        cache.drains++;
+
+        for(size_t i = 0; i < frame_cache_batch; i++)
+            buddy_free(cache.frames[--cache.cnt], 1);
+    }
+
+    cache.frames[cache.cnt++] = base;
+
+    irq_restore(rflags);
+}
+
+// hands this cpu's cached frames back to the buddy allocator, where any request can use them
+static void cache_drain() {
+    size_t rflags = irq_save();
+
+    frame_cache &cache = smp::core_local().frame_cache;
+
+    cache.drains++;
+
+    while(cache.cnt)
+        buddy_free(cache.frames[--cache.cnt], 1);
+
+    irq_restore(rflags);
+}
+
+void register_shrinker(size_t (*shrinker)()) {
+    spin_lock(&shrinker_lock);
+
+    if(shrinker_cnt < max_shrinkers)
+        shrinkers[shrinker_cnt++] = shrinker;
+
+    spin_release(&shrinker_lock);
+}
+
+static size_t run_shrinkers() {
+    if(!spin_trylock(&shrinker_lock))
+        return 0;
+
+    size_t ret = 0;
+    for(size_t i = 0; i < shrinker_cnt; i++)
+        ret += shrinkers[i]();
+
+    spin_release(&shrinker_lock);
+
+    return ret;
+}
+
+static size_t alloc_frames(size_t cnt, size_t numa_node, size_t align, uint64_t site) {
+    size_t alloc = -1;
+
+    if(numa_node >= numa::node_cnt)
+        numa_node = 0;
+
+    if(cnt == 1 && align == 1 && smp::percpu_online && numa_node == local_node())
+        alloc = cache_alloc();
+
+    if(alloc == -1ull)
+        alloc = buddy_alloc(cnt, align, numa_node);
+
+    // single frames the shrinkers free go to this cpu's cache, the retry has to see them
+    if(alloc == -1ull && run_shrinkers()) {
+        if(smp::percpu_online)
+            cache_drain();
+
+        alloc = buddy_alloc(cnt, align, numa_node);
+    }
+
+    if(alloc == -1ull) {
+        print("PMM: out of memory\n");
+        return -1;
+    }
+
+    __atomic_add_fetch(&total_used_mem, cnt * vmm::page_size, __ATOMIC_RELAXED);
+    page_setup(alloc, cnt, 0, site);
+
+    return alloc;
+}
+
+static size_t calloc_frames(size_t cnt, size_t numa_node, size_t align, uint64_t site) {
+    size_t allocation = alloc_frames(cnt, numa_node, align, site);
     memset64((uint64_t*)(allocation + vmm::high_vma), 0, (cnt * vmm::page_size) / 8);
     return allocation;
 }
 
+size_t alloc_node(size_t cnt, size_t numa_node, size_t align) {
+    return alloc_frames(cnt, numa_node, align, profile_caller());
+}
+
+size_t calloc_node(size_t cnt, size_t numa_node, size_t align) {
+    return calloc_frames(cnt, numa_node, align, profile_caller());
+}
+
+size_t alloc(size_t cnt, size_t align) {
+    return alloc_frames(cnt, local_node(), align, profile_caller());
+}
+
+size_t calloc(size_t cnt, size_t align) {
+    if(cnt == 1 && align == 1) {
+        zero_pool &pool = zero_pools[local_node()];
+        size_t allocation = -1;
+
+        spin_lock(&pool.lock);
+        if(pool.cnt)
+            allocation = pool.frames[--pool.cnt];
+        spin_release(&pool.lock);
+
+        if(allocation != -1ull) {
+            __atomic_add_fetch(&zero_pool_hits, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&total_used_mem, vmm::page_size, __ATOMIC_RELAXED);
+            page_setup(allocation, 1, 0, profile_caller());
+            return allocation;
+        }
+
+        __atomic_add_fetch(&zero_pool_misses, 1, __ATOMIC_RELAXED);
+    }
+
+    return calloc_frames(cnt, local_node(), align, profile_caller());
+}
+
 void free(size_t base, size_t cnt) {
-    mem_chunk *chunk = root;
-    do {
-        if(base >= chunk->base && (base + cnt * vmm::page_size) <= (chunk->base + chunk->page_cnt * vmm::page_size)) {
-            return chunk->free(base - chunk->base, cnt);
+    __atomic_sub_fetch(&total_used_mem, cnt * vmm::page_size, __ATOMIC_RELAXED);
+    page_reset(base, cnt);
+
+    if(cnt == 1) {
+        mem_chunk *chunk = find_chunk(base);
+        if(chunk && chunk->drop_movable(base - chunk->base))
+            return;
+    }
+
+    if(cnt == 1 && smp::percpu_online)
+        return cache_free(base);
+
+    buddy_free(base, cnt);
+}
+
+void set_movable(size_t base, uint64_t *pte) {
+    mem_chunk *chunk = find_chunk(base);
+    if(chunk)
+        chunk->set_movable(base - chunk->base, pte);
+}
+
+void clear_movable(size_t base) {
+    mem_chunk *chunk = find_chunk(base);
+    if(chunk)
+        chunk->clear_movable(base - chunk->base);
+}
+
+size_t compact(size_t cnt, size_t numa_node) {
+    if(numa_node >= numa::node_cnt)
+        numa_node = 0;
+
+    size_t order = log2(pow2_roundup(cnt));
+
+    spin_lock(&compact_lock);
+
+    for(size_t i = 0; i < numa::node_cnt; i++) {
+        size_t target = numa::fallback[numa_node][i];
+
+        for(mem_chunk *chunk = root; chunk != NULL; chunk = chunk->next) {
+            if(chunk->numa_node != target || chunk->page_cnt < cnt)
+                continue;
+
+            size_t block = chunk->compact(order);
+            if(block != -1ull) {
+                spin_release(&compact_lock);
+                __atomic_add_fetch(&compact_success, 1, __ATOMIC_RELAXED);
+                return block;
+            }
         }
-        chunk = chunk->next;
-    } while(chunk != NULL);
+    }
+
+    spin_release(&compact_lock);
+    __atomic_add_fetch(&compact_fail, 1, __ATOMIC_RELAXED);
+
+    return -1;
+}
+
+static size_t reserve_pop(size_t cnt) {
+    size_t ret = -1;
+
+    spin_lock(&reserve_lock);
+
+    if(cnt == giant_page_cnt && giant_reserve_cnt) {
+        ret = giant_reserve[--giant_reserve_cnt];
+    } else if(cnt == huge_page_cnt && huge_reserve_cnt) {
+        ret = huge_reserve[--huge_reserve_cnt];
+    }
+
+    spin_release(&reserve_lock);
+
+    return ret;
+}
+
+static bool reserve_push(size_t base, size_t cnt) {
+    bool ret = false;
+
+    spin_lock(&reserve_lock);
+
+    if(cnt == giant_page_cnt && giant_reserve_cnt < giant_reserve_target) {
+        giant_reserve[giant_reserve_cnt++] = base;
+        ret = true;
+    } else if(cnt == huge_page_cnt && huge_reserve_cnt < huge_reserve_target) {
+        huge_reserve[huge_reserve_cnt++] = base;
+        ret = true;
+    }
+
+    spin_release(&reserve_lock);
+
+    return ret;
+}
+
+static size_t huge_frames(size_t cnt, uint64_t site, bool may_compact = true) {
+    size_t numa_node = local_node();
+
+    size_t alloc = buddy_alloc(cnt, cnt, numa_node);
+
+    if(alloc == -1ull)
+        alloc = reserve_pop(cnt);
+
+    if(alloc == -1ull && may_compact)
+        alloc = compact(cnt, numa_node);
+
+    if(alloc == -1ull) {
+        if(may_compact)
+            print("PMM: unable to allocate {x} contiguous frames\n", cnt);
+        return -1;
+    }
+
+    __atomic_add_fetch(&total_used_mem, cnt * vmm::page_size, __ATOMIC_RELAXED);
+    page_setup(alloc, cnt, cnt == giant_page_cnt ? page_giant : page_huge, site);
+
+    return alloc;
+}
+
+size_t alloc_huge(size_t cnt) {
+    return huge_frames(cnt, profile_caller());
+}
+
+size_t calloc_huge(size_t cnt) {
+    size_t allocation = huge_frames(cnt, profile_caller());
+    if(allocation == -1ull)
+        return -1;
+
+    memset64_nt(reinterpret_cast<uint64_t*>(allocation + vmm::high_vma), 0, (cnt * vmm::page_size) / 8);
+
+    return allocation;
+}
+
+size_t calloc_huge_nowait(size_t cnt) {
+    size_t allocation = huge_frames(cnt, profile_caller(), false);
+    if(allocation == -1ull)
+        return -1;
+
+    memset64_nt(reinterpret_cast<uint64_t*>(allocation + vmm::high_vma), 0, (cnt * vmm::page_size) / 8);
+
+    return allocation;
+}
+
+void free_huge(size_t base, size_t cnt) {
+    __atomic_sub_fetch(&total_used_mem, cnt * vmm::page_size, __ATOMIC_RELAXED);
+    page_reset(base, cnt);
+
+    if(reserve_push(base, cnt))
+        return;
+
+    buddy_free(base, cnt);
+}
+
+// turns a huge or giant allocation of cnt frames into independently refcounted blocks of sub_cnt frames,
+// every block inherits the refcount of the head
+void split_huge(size_t base, size_t cnt, size_t sub_cnt) {
+    page *head = phys_to_page(base);
+    if(head == NULL)
+        return;
+
+    uint32_t flags = head->flags & ~(page_huge | page_giant);
+    if(sub_cnt == huge_page_cnt)
+        flags |= page_huge;
+
+    for(size_t i = 0; i < cnt; i += sub_cnt) {
+        page *pg = phys_to_page(base + i * vmm::page_size);
+        if(pg == NULL)
+            break;
+
+        pg->flags = flags;
+
+        if(pg == head)
+            continue;
+
+        pg->refcnt = head->refcnt;
+        pg->owner = NULL;
+        pg->index = 0;
+
+#ifdef ALLOC_PROFILE
+        pg->alloc_site = head->alloc_site;
+        pg->alloc_time = head->alloc_time;
+#endif
+    }
+}
+
+void page_ref(page *pg) {
+    __atomic_add_fetch(&pg->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+size_t page_unref(page *pg) {
+    size_t refcnt = __atomic_sub_fetch(&pg->refcnt, 1, __ATOMIC_ACQ_REL);
+    if(refcnt)
+        return refcnt;
+
+    if(pg->flags & page_giant) {
+        free_huge(page_to_phys(pg), giant_page_cnt);
+    } else if(pg->flags & page_huge) {
+        free_huge(page_to_phys(pg), huge_page_cnt);
+    } else {
+        free(page_to_phys(pg), 1);
+    }
+
+    return 0;
+}
+
+bool page_trylock(page *pg) {
+    return !(__atomic_fetch_or(&pg->flags, page_locked, __ATOMIC_ACQUIRE) & page_locked);
+}
+
+void page_lock(page *pg) {
+    while(!page_trylock(pg))
+        asm ("pause");
+}
+
+void page_unlock(page *pg) {
+    __atomic_and_fetch(&pg->flags, ~page_locked, __ATOMIC_RELEASE);
+}
+
+void lru_init(lru_list *list) {
+    list->head = lru_end;
+    list->tail = lru_end;
+    list->cnt = 0;
+    list->lock = 0;
+}
+
+void lru_push(lru_list *list, page *pg) {
+    uint32_t pfn = page_to_pfn(pg);
+
+    spin_lock(&list->lock);
+
+    pg->lru_last = lru_end;
+    pg->lru_next = list->head;
+
+    if(list->head != lru_end) {
+        pages[list->head].lru_last = pfn;
+    } else {
+        list->tail = pfn;
+    }
+
+    list->head = pfn;
+    list->cnt++;
+
+    spin_release(&list->lock);
+}
+
+void lru_remove(lru_list *list, page *pg) {
+    spin_lock(&list->lock);
+
+    if(pg->lru_next != lru_end) {
+        pages[pg->lru_next].lru_last = pg->lru_last;
+    } else {
+        list->tail = pg->lru_last;
+    }
+
+    if(pg->lru_last != lru_end) {
+        pages[pg->lru_last].lru_next = pg->lru_next;
+    } else {
+        list->head = pg->lru_next;
+    }
+
+    pg->lru_next = lru_end;
+    pg->lru_last = lru_end;
+    list->cnt--;
+
+    spin_release(&list->lock);
+}
+
+page *lru_pop(lru_list *list) {
+    spin_lock(&list->lock);
+
+    if(list->tail == lru_end) {
+        spin_release(&list->lock);
+        return NULL;
+    }
+
+    page *pg = &pages[list->tail];
+
+    list->tail = pg->lru_last;
+    if(list->tail != lru_end) {
+        pages[list->tail].lru_next = lru_end;
+    } else {
+        list->head = lru_end;
+    }
+
+    pg->lru_next = lru_end;
+    pg->lru_last = lru_end;
+    list->cnt--;
+
+    spin_release(&list->lock);
+
+    return pg;
+}
+
+// pools that fell below zero_pool_low are topped up to zero_pool_size, in between the thread halts its cpu and leaves
+// it to other tasks instead of spinning on pools that are already full
+void zero_thread() {
+    for(;;) {
+        for(size_t numa_node = 0; numa_node < numa::node_cnt; numa_node++) {
+            zero_pool &pool = zero_pools[numa_node];
+
+            if(__atomic_load_n(&pool.cnt, __ATOMIC_RELAXED) >= zero_pool_low)
+                continue;
+
+            while(pool.cnt < zero_pool_size) {
+                size_t batch[zero_pool_batch];
+                size_t cnt = 0;
+
+                while(cnt < zero_pool_batch && pool.cnt + cnt < zero_pool_size) {
+                    size_t page = buddy_alloc(1, 1, numa_node);
+                    if(page == -1ull)
+                        break;
+
+                    memset64_nt(reinterpret_cast<uint64_t*>(page + vmm::high_vma), 0, vmm::page_size / 8);
+                    batch[cnt++] = page;
+                }
+
+                if(!cnt)
+                    break;
+
+                spin_lock(&pool.lock);
+                while(cnt && pool.cnt < zero_pool_size)
+                    pool.frames[pool.cnt++] = batch[--cnt];
+                spin_release(&pool.lock);
+
+                while(cnt)
+                    buddy_free(batch[--cnt], 1);
+            }
+        }
+
+        ksleep_idle(zero_pool_interval);
+    }
 }
 
 }
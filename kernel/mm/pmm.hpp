@@ -4,17 +4,125 @@
 #include <stivale.hpp>
 #include <memutils.hpp>
 #include <mm/vmm.hpp>
+#include <mm/profile.hpp>
 
 namespace pmm {
 
+constexpr size_t frame_cache_size = 64;
+constexpr size_t frame_cache_batch = 32;
+
+struct frame_cache {
+    size_t frames[frame_cache_size];
+    size_t cnt;
+
+    size_t hits;
+    size_t misses;
+    size_t drains;
+};
+
+constexpr size_t max_shrinkers = 8;
+
+constexpr size_t zero_pool_size = 512;
+constexpr size_t zero_pool_batch = 32;
+constexpr size_t zero_pool_low = 128; // frames left before the zero thread refills a pool
+constexpr size_t zero_pool_interval = 10; // ms between checks of the pools
+
+constexpr size_t huge_page_cnt = 0x200;
+constexpr size_t giant_page_cnt = 0x40000;
+
+constexpr uint32_t page_dirty = (1 << 0);
+constexpr uint32_t page_locked = (1 << 1);
+constexpr uint32_t page_slab = (1 << 2);
+constexpr uint32_t page_pagecache = (1 << 3);
+constexpr uint32_t page_huge = (1 << 4);
+constexpr uint32_t page_giant = (1 << 5);
+
+constexpr uint32_t lru_end = 0xffffffff;
+
+struct page {
+    uint32_t refcnt;
+    uint32_t flags;
+    void *owner;
+    uint32_t lru_next;
+    uint32_t lru_last;
+    size_t index;
+#ifdef ALLOC_PROFILE
+    uint64_t alloc_site = 0;
+    uint64_t alloc_time = 0;
+#endif
+};
+
+static_assert(sizeof(page) == (profile::enabled ? 48 : 32));
+
+struct lru_list {
+    uint32_t head;
+    uint32_t tail;
+    size_t cnt;
+    size_t lock;
+};
+
+inline page *pages = NULL;
+inline size_t max_pfn = 0;
+
+inline page *pfn_to_page(size_t pfn) {
+    return pfn < max_pfn ? &pages[pfn] : NULL;
+}
+
+inline page *phys_to_page(size_t paddr) {
+    return pfn_to_page(paddr / vmm::page_size);
+}
+
+inline size_t page_to_pfn(page *pg) {
+    return pg - pages;
+}
+
+inline size_t page_to_phys(page *pg) {
+    return page_to_pfn(pg) * vmm::page_size;
+}
+
 inline size_t total_mem = 0;
 inline size_t total_used_mem = 0;
 
+inline size_t zero_pool_hits = 0;
+inline size_t zero_pool_misses = 0;
+
+inline size_t compact_success = 0;
+inline size_t compact_fail = 0;
+
 void init(stivale *stivale);
-size_t alloc(size_t cnt, size_t align = 1);
-size_t calloc(size_t cnt, size_t align = 1);
+profile_noinline size_t alloc(size_t cnt, size_t align = 1);
+profile_noinline size_t calloc(size_t cnt, size_t align = 1);
+profile_noinline size_t alloc_node(size_t cnt, size_t numa_node, size_t align = 1);
+profile_noinline size_t calloc_node(size_t cnt, size_t numa_node, size_t align = 1);
 void free(size_t base, size_t cnt);
 
+profile_noinline size_t alloc_huge(size_t cnt);
+profile_noinline size_t calloc_huge(size_t cnt);
+// never compacts or reports a failure, for callers that fall back to 4KiB frames
+profile_noinline size_t calloc_huge_nowait(size_t cnt);
+void free_huge(size_t base, size_t cnt);
+void split_huge(size_t base, size_t cnt, size_t sub_cnt);
+
+void register_shrinker(size_t (*shrinker)());
+
+void set_movable(size_t base, uint64_t *pte);
+void clear_movable(size_t base);
+size_t compact(size_t cnt, size_t numa_node);
+
+void page_ref(page *pg);
+size_t page_unref(page *pg);
+
+void page_lock(page *pg);
+bool page_trylock(page *pg);
+void page_unlock(page *pg);
+
+void lru_init(lru_list *list);
+void lru_push(lru_list *list, page *pg);
+void lru_remove(lru_list *list, page *pg);
+page *lru_pop(lru_list *list);
+
+void zero_thread();
+
 }
 
 #endif
@@ -0,0 +1,151 @@
+#include <mm/profile.hpp>
+#include <mm/pmm.hpp>
+#include <mm/numa.hpp>
+#include <sched/smp.hpp>
+#include <cpu.hpp>
+
+namespace profile {
+
+static site *tables[numa::max_cpus];
+static size_t table_pages = div_roundup(site_cnt * sizeof(site), vmm::page_size);
+
+static site *lookup(site *table, size_t cnt, uint64_t addr) {
+    size_t index = (addr * 0x9e3779b97f4a7c15) >> 32;
+
+    for(size_t i = 0; i < cnt; i++) {
+        site *cur = &table[(index + i) % cnt];
+
+        if(cur->addr == addr)
+            return cur;
+
+        if(cur->addr == 0) {
+            cur->addr = addr;
+            return cur;
+        }
+    }
+
+    return NULL;
+}
+
+static site *local_site(uint64_t addr) {
+    if(!smp::percpu_online)
+        return NULL;
+
+    site *table = tables[smp::core_local().index];
+    if(table == NULL)
+        return NULL;
+
+    return lookup(table, site_cnt, addr);
+}
+
+void init() {
+    if constexpr(!enabled)
+        return;
+
+    for(size_t i = 0; i < smp::cpus.size() && i < numa::max_cpus; i++)
+        tables[i] = reinterpret_cast<site*>(pmm::calloc(table_pages) + vmm::high_vma);
+}
+
+void record_alloc(uint64_t addr, size_t bytes) {
+    size_t rflags = irq_save();
+
+    site *cur = local_site(addr);
+    if(cur) {
+        cur->allocs++;
+        cur->live_bytes += bytes;
+        cur->total_bytes += bytes;
+    } else {
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+    }
+
+    irq_restore(rflags);
+}
+
+void record_free(uint64_t addr, size_t bytes, uint64_t lifetime) {
+    if(addr == 0)
+        return;
+
+    size_t rflags = irq_save();
+
+    site *cur = local_site(addr);
+    if(cur) {
+        cur->frees++;
+        cur->live_bytes -= bytes;
+        cur->lifetime += lifetime;
+    } else {
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+    }
+
+    irq_restore(rflags);
+}
+
+void report() {
+    if constexpr(!enabled) {
+        print("PROFILE: allocation profiling is disabled (build with ALLOC_PROFILE=1)\n");
+        return;
+    }
+
+    size_t pages = div_roundup(report_cnt * sizeof(site), vmm::page_size);
+    size_t base = pmm::calloc(pages);
+    if(base == -1ull)
+        return;
+
+    site *merged = reinterpret_cast<site*>(base + vmm::high_vma);
+
+    for(size_t i = 0; i < numa::max_cpus; i++) {
+        if(tables[i] == NULL)
+            continue;
+
+        for(size_t j = 0; j < site_cnt; j++) {
+            site &src = tables[i][j];
+            if(src.addr == 0)
+                continue;
+
+            site *dest = lookup(merged, report_cnt, src.addr);
+            if(dest == NULL)
+                continue;
+
+            dest->allocs += src.allocs;
+            dest->frees += src.frees;
+            dest->live_bytes += src.live_bytes;
+            dest->total_bytes += src.total_bytes;
+            dest->lifetime += src.lifetime;
+        }
+    }
+
+    size_t cnt = 0;
+    for(size_t i = 0; i < report_cnt; i++) {
+        if(merged[i].addr)
+            merged[cnt++] = merged[i];
+    }
+
+    for(size_t i = 1; i < cnt; i++) {
+        site key = merged[i];
+        size_t j = i;
+
+        for(; j > 0 && merged[j - 1].live_bytes < key.live_bytes; j--)
+            merged[j] = merged[j - 1];
+
+        merged[j] = key;
+    }
+
+    print("PROFILE: {} call sites ({} records dropped)\n", cnt, dropped);
+
+    for(size_t i = 0; i < cnt; i++) {
+        site &cur = merged[i];
+        uint64_t avg_lifetime = cur.frees ? cur.lifetime / cur.frees : 0;
+        size_t live_bytes = cur.live_bytes > 0 ? cur.live_bytes : 0;
+
+        print("PROFILE: {x} live {} total {} allocs {} frees {} avg lifetime {} cycles\n",
+                cur.addr, live_bytes, cur.total_bytes, cur.allocs, cur.frees, avg_lifetime);
+    }
+
+    pmm::free(base, pages);
+}
+
+extern "C" void syscall_alloc_report(regs *regs_cur) {
+    report();
+    regs_cur->rax = enabled ? 0 : -1;
+}
+
+}
@@ -0,0 +1,48 @@
+#ifndef PROFILE_HPP_
+#define PROFILE_HPP_
+
+#include <types.hpp>
+
+#ifdef ALLOC_PROFILE
+#define profile_noinline [[gnu::noinline]]
+#define profile_caller() reinterpret_cast<uint64_t>(__builtin_return_address(0))
+#else
+#define profile_noinline
+#define profile_caller() 0ull
+#endif
+
+namespace profile {
+
+#ifdef ALLOC_PROFILE
+constexpr bool enabled = true;
+#else
+constexpr bool enabled = false;
+#endif
+
+constexpr size_t site_cnt = 512;
+constexpr size_t report_cnt = 2048;
+
+struct site {
+    uint64_t addr;
+    size_t allocs;
+    size_t frees;
+    ssize_t live_bytes;
+    size_t total_bytes;
+    uint64_t lifetime;
+};
+
+struct header {
+    uint64_t site;
+    uint64_t time;
+};
+
+inline size_t dropped = 0;
+
+void init();
+void record_alloc(uint64_t addr, size_t bytes);
+void record_free(uint64_t addr, size_t bytes, uint64_t lifetime);
+void report();
+
+}
+
+#endif
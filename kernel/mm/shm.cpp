@@ -0,0 +1,193 @@
+#include <mm/shm.hpp>
+#include <mm/pmm.hpp>
+#include <mm/slab.hpp>
+
+namespace mm {
+
+static kmm::object_cache<shm_object> shm_cache("shm_object");
+
+static shm_fs shmfs;
+
+static shm_object *to_shm(vfs::node *file) {
+    return reinterpret_cast<shm_object*>(file);
+}
+
+// covers length bytes with the frame array, frames past the new end lose the object's reference. lock must be held
+static void resize(shm_object *object, size_t length) {
+    size_t cnt = div_roundup(length, vmm::page_size);
+
+    for(size_t i = cnt; i < object->frame_cnt; i++) {
+        if(object->frames[i])
+            pmm::page_unref(pmm::phys_to_page(object->frames[i]));
+    }
+
+    if(cnt != object->frame_cnt) {
+        object->frames = reinterpret_cast<size_t*>(kmm::recalloc(object->frames, (cnt ? cnt : 1) * sizeof(size_t)));
+        object->frame_cnt = cnt;
+    }
+
+    object->stat_buf.st_size = length;
+}
+
+// frame backing page index with a reference for the caller, absent pages are zero filled when alloc is set
+// and give 0 otherwise. -1 is returned past the end of the object or when no memory is left
+static size_t get_frame(shm_object *object, size_t index, bool alloc) {
+    spin_lock(&object->lock);
+
+    if(index >= object->frame_cnt) {
+        spin_release(&object->lock);
+        return -1;
+    }
+
+    size_t paddr = object->frames[index];
+
+    if(paddr == 0 && alloc) {
+        paddr = pmm::calloc(1);
+        if(paddr == -1ull) {
+            spin_release(&object->lock);
+            return -1;
+        }
+
+        object->frames[index] = paddr;
+    }
+
+    if(paddr != 0)
+        pmm::page_ref(pmm::phys_to_page(paddr));
+
+    spin_release(&object->lock);
+
+    return paddr;
+}
+
+// the object starts with one reference that belongs to the caller
+vfs::node *shm_create(lib::string name, size_t length) {
+    shm_object *object = shm_cache.alloc();
+    memset8(reinterpret_cast<uint8_t*>(object), 0, sizeof(shm_object));
+
+    object->vfs_node.absolute_path = lib::string("memfd:") + name;
+    object->vfs_node.name = name;
+    object->vfs_node.filesystem = &shmfs;
+    object->vfs_node.stat_cur = &object->stat_buf;
+
+    object->frames = reinterpret_cast<size_t*>(kmm::calloc(sizeof(size_t)));
+    object->refcnt = 1;
+
+    resize(object, length);
+
+    return &object->vfs_node;
+}
+
+bool is_shm(vfs::node *file) {
+    return file->filesystem == &shmfs;
+}
+
+void shm_ref(vfs::node *file) {
+    __atomic_add_fetch(&to_shm(file)->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+void shm_unref(vfs::node *file) {
+    shm_object *object = to_shm(file);
+
+    if(__atomic_sub_fetch(&object->refcnt, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    resize(object, 0);
+    kmm::free(object->frames);
+
+    object->vfs_node.~node();
+    shm_cache.free(object);
+}
+
+// frame for page index of a mapping, the caller gets its own reference
+size_t shm_get(vfs::node *file, size_t index) {
+    return get_frame(to_shm(file), index, true);
+}
+
+int shm_fs::read(vfs::node *vfs_node, off_t off, off_t cnt, void *buf) {
+    uint8_t *dest = reinterpret_cast<uint8_t*>(buf);
+
+    if(off > vfs_node->stat_cur->st_size)
+        return -1;
+
+    if(off + cnt > vfs_node->stat_cur->st_size)
+        cnt = vfs_node->stat_cur->st_size - off;
+
+    for(off_t end = off + cnt; off < end;) {
+        size_t page_off = off & (vmm::page_size - 1);
+        size_t chunk = vmm::page_size - page_off;
+        if(chunk > static_cast<size_t>(end - off))
+            chunk = end - off;
+
+        size_t paddr = get_frame(to_shm(vfs_node), off / vmm::page_size, false);
+
+        if(paddr == 0 || paddr == -1ull) {
+            memset8(dest, 0, chunk);
+        } else {
+            memcpy8(dest, reinterpret_cast<uint8_t*>(paddr + page_off + vmm::high_vma), chunk);
+            pmm::page_unref(pmm::phys_to_page(paddr));
+        }
+
+        dest += chunk;
+        off += chunk;
+    }
+
+    return cnt;
+}
+
+// writes past the end grow the object
+int shm_fs::write(vfs::node *vfs_node, off_t off, off_t cnt, void *buf) {
+    shm_object *object = to_shm(vfs_node);
+    uint8_t *src = reinterpret_cast<uint8_t*>(buf);
+
+    spin_lock(&object->lock);
+
+    if(off + cnt > object->stat_buf.st_size)
+        resize(object, off + cnt);
+
+    spin_release(&object->lock);
+
+    for(off_t end = off + cnt; off < end;) {
+        size_t page_off = off & (vmm::page_size - 1);
+        size_t chunk = vmm::page_size - page_off;
+        if(chunk > static_cast<size_t>(end - off))
+            chunk = end - off;
+
+        size_t paddr = get_frame(object, off / vmm::page_size, true);
+        if(paddr == -1ull)
+            return -1;
+
+        memcpy8(reinterpret_cast<uint8_t*>(paddr + page_off + vmm::high_vma), src, chunk);
+        pmm::page_unref(pmm::phys_to_page(paddr));
+
+        src += chunk;
+        off += chunk;
+    }
+
+    return cnt;
+}
+
+// every fd holds a reference
+int shm_fs::open(vfs::node *vfs_node, [[maybe_unused]] uint16_t status) {
+    shm_ref(vfs_node);
+    return 0;
+}
+
+int shm_fs::close(vfs::node *vfs_node) {
+    shm_unref(vfs_node);
+    return 0;
+}
+
+int shm_fs::truncate(vfs::node *vfs_node, off_t length) {
+    shm_object *object = to_shm(vfs_node);
+
+    if(length < 0)
+        return -1;
+
+    spin_lock(&object->lock);
+    resize(object, length);
+    spin_release(&object->lock);
+
+    return 0;
+}
+
+}
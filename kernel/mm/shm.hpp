@@ -0,0 +1,38 @@
+#ifndef SHM_HPP_
+#define SHM_HPP_
+
+#include <fs/vfs.hpp>
+
+namespace mm {
+
+// anonymous shared memory, its frames live until the last fd and the last vma referring to it are gone
+struct shm_object {
+    vfs::node vfs_node;
+    stat stat_buf;
+
+    size_t *frames; // 0 until the page is first touched
+    size_t frame_cnt;
+
+    size_t refcnt;
+    size_t lock;
+};
+
+struct shm_fs : vfs::fs {
+    shm_fs() : vfs::fs(vfs::fs::shmfs_signature) { }
+
+    int read(vfs::node *vfs_node, off_t off, off_t cnt, void *buf);
+    int write(vfs::node *vfs_node, off_t off, off_t cnt, void *buf);
+    int open(vfs::node *vfs_node, uint16_t status);
+    int close(vfs::node *vfs_node);
+    int truncate(vfs::node *vfs_node, off_t length);
+};
+
+vfs::node *shm_create(lib::string name, size_t length);
+bool is_shm(vfs::node *file);
+void shm_ref(vfs::node *file);
+void shm_unref(vfs::node *file);
+size_t shm_get(vfs::node *file, size_t index);
+
+}
+
+#endif
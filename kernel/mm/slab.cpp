@@ -1,45 +1,149 @@
 #include <mm/slab.hpp>
+#include <mm/vmalloc.hpp>
+#include <mm/numa.hpp>
+#include <sched/smp.hpp>
 #include <cpu.hpp>
 
-kmm::cache cache32(NULL, 0, 32);
-
 namespace kmm {
 
 static cache *cache_root = NULL;
-static size_t slab_lock = 0;
+static cache *size_caches[64];
+static size_t cache_list_lock = 0;
+
+static magazine *magazine_free = NULL;
+static size_t magazine_lock = 0;
+
+static magazine *alloc_magazine() {
+    spin_lock(&magazine_lock);
+
+    while(magazine_free == NULL) {
+        spin_release(&magazine_lock);
+
+        size_t page = pmm::calloc(1);
+        if(page == -1ull)
+            return NULL;
 
-static slab *alloc_slab(cache *parent) { 
-    slab *new_slab = reinterpret_cast<slab*>(pmm::calloc(parent->pages_per_slab) + vmm::high_vma);
+        magazine *mags = reinterpret_cast<magazine*>(page + vmm::high_vma);
+
+        spin_lock(&magazine_lock);
+
+        for(size_t i = 0; i < vmm::page_size / sizeof(magazine); i++) {
+            mags[i].next = magazine_free;
+            magazine_free = &mags[i];
+        }
+    }
+
+    magazine *mag = magazine_free;
+    magazine_free = mag->next;
+
+    spin_release(&magazine_lock);
+
+    mag->cnt = 0;
+    mag->next = NULL;
+
+    return mag;
+}
+
+static void free_magazine(magazine *mag) {
+    spin_lock(&magazine_lock);
+
+    mag->next = magazine_free;
+    magazine_free = mag;
+
+    spin_release(&magazine_lock);
+}
+
+static void push_slab(slab **head, slab *node) {
+    node->last = NULL;
+    node->next = *head;
+
+    if(*head != NULL)
+        (*head)->last = node;
+
+    *head = node;
+}
+
+static slab *alloc_slab(cache *parent, size_t reserve = 0) { 
+    size_t base = pmm::calloc(parent->pages_per_slab);
+    if(base == -1ull)
+        return NULL;
+
+    slab *new_slab = reinterpret_cast<slab*>(base + vmm::high_vma);
+
+    for(size_t i = 0; i < parent->pages_per_slab; i++) {
+        pmm::page *pg = pmm::phys_to_page(base + i * vmm::page_size);
+        pg->flags |= pmm::page_slab;
+        pg->owner = new_slab;
+    }
+
+    new_slab->color = parent->color_next;
+    new_slab->buf = reinterpret_cast<uint8_t*>(align_up(reinterpret_cast<size_t>(new_slab) + sizeof(slab) + reserve, parent->align) + new_slab->color);
+
+    parent->color_next += parent->color_step;
+    if(parent->color_next > parent->color_max)
+        parent->color_next = 0;
 
-    new_slab->bitmap = reinterpret_cast<uint8_t*>(reinterpret_cast<size_t>(new_slab) + sizeof(slab));
-    new_slab->buf = reinterpret_cast<uint8_t*>(align_up(reinterpret_cast<size_t>(new_slab) + sizeof(slab) + objects_per_slab / 8, 16));
     new_slab->available_objects = objects_per_slab;
     new_slab->parent = parent;
+    new_slab->freelist = NULL;
 
-    if(parent->slab_empty == NULL) { 
-        parent->slab_empty = new_slab;
-    } else {
-        slab *node = parent->slab_empty;
-        while(node->next != NULL)
-            node = node->next;
-        node->next = new_slab;
-        new_slab->last = node;
+    for(size_t i = objects_per_slab; i > 0; i--) {
+        uint8_t *obj = new_slab->buf + (i - 1) * parent->stride;
+
+        if(parent->ctor)
+            parent->ctor(obj);
+
+        *reinterpret_cast<void**>(obj + parent->link_offset) = new_slab->freelist;
+        new_slab->freelist = obj;
     }
 
+    parent->active_slabs++;
+    parent->empty_slabs++;
+
+    push_slab(&parent->slab_empty, new_slab);
+
     return new_slab;
 }
 
-cache::cache(const char *name, size_t flags, size_t object_size) : name(name), flags(flags), object_size(object_size) {
-    pages_per_slab = div_roundup(object_size * objects_per_slab + sizeof(slab) + objects_per_slab / 8, vmm::page_size);
+cache::cache(const char *name, size_t flags, size_t object_size, size_t align, void (*ctor)(void*), void (*dtor)(void*)) : name(name), flags(flags), object_size(object_size), align(align),
+                                                                                                                    active_objects(0), active_slabs(0), empty_slabs(0),
+                                                                                                                    empty_low(slab_empty_low), empty_high(slab_empty_high), ctor(ctor), dtor(dtor),
+                                                                                                                    slab_empty(NULL), slab_partial(NULL), slab_full(NULL),
+                                                                                                                    depot_full(NULL), depot_empty(NULL), depot_full_cnt(0), depot_empty_cnt(0),
+                                                                                                                    next(NULL), last(NULL), lock(0), depot_lock(0) {
+    if(this->align < 16)
+        this->align = 16;
+
+    if(flags & cache_cacheline_aligned && this->align < cacheline_size)
+        this->align = cacheline_size;
+
+    link_offset = ctor ? align_up(object_size, sizeof(void*)) : 0;
+    stride = align_up(link_offset + sizeof(void*) > object_size ? link_offset + sizeof(void*) : object_size, this->align);
+
+    pages_per_slab = div_roundup(stride * objects_per_slab + sizeof(slab) + sizeof(cache) + this->align, vmm::page_size);
+
+    size_t slack = pages_per_slab * vmm::page_size - (stride * objects_per_slab + sizeof(slab) + sizeof(cache) + this->align);
+
+    color_step = this->align > cacheline_size ? this->align : cacheline_size;
+    color_max = (slack / color_step) * color_step;
+    color_next = 0;
+
+    cpu_caches = NULL;
+}
+
+cache *create_cache(const char *name, size_t object_size, size_t align, size_t flags, void (*ctor)(void*), void (*dtor)(void*)) {
+    cache tmp(name, flags, object_size, align, ctor, dtor);
+    tmp.cpu_caches = reinterpret_cast<cpu_cache*>(pmm::calloc(div_roundup(numa::max_cpus * sizeof(cpu_cache), vmm::page_size)) + vmm::high_vma);
 
-    slab *root_slab = alloc_slab(this);
+    slab *root_slab = alloc_slab(&tmp, sizeof(cache));
 
-    *reinterpret_cast<cache*>(root_slab->buf) = *this;
-    cache *new_cache = reinterpret_cast<cache*>(root_slab->buf);
-    root_slab->buf += sizeof(cache);
+    cache *new_cache = reinterpret_cast<cache*>(reinterpret_cast<size_t>(root_slab) + sizeof(slab));
+    *new_cache = tmp;
 
     root_slab->parent = new_cache;
 
+    spin_lock(&cache_list_lock);
+
     cache *node = cache_root;
     if(node == NULL) {
         cache_root = new_cache;
@@ -49,9 +153,142 @@ cache::cache(const char *name, size_t flags, size_t object_size) : name(name), f
         node->next = new_cache;
         new_cache->last = node;
     }
+
+    if(name == NULL && object_size == pow2_roundup(object_size) && size_caches[log2(object_size)] == NULL)
+        size_caches[log2(object_size)] = new_cache;
+
+    spin_release(&cache_list_lock);
+
+    return new_cache;
+}
+
+magazine *cache::depot_pop(magazine **head, size_t *cnt) {
+    spin_lock(&depot_lock);
+
+    magazine *mag = *head;
+    if(mag != NULL) {
+        *head = mag->next;
+        (*cnt)--;
+    }
+
+    spin_release(&depot_lock);
+
+    return mag;
+}
+
+void cache::depot_push(magazine **head, size_t *cnt, magazine *mag) {
+    spin_lock(&depot_lock);
+
+    mag->next = *head;
+    *head = mag;
+    (*cnt)++;
+
+    spin_release(&depot_lock);
 }
 
 void *cache::alloc_obj() {
+    if(!smp::percpu_online || smp::core_local().index >= numa::max_cpus)
+        return slab_alloc();
+
+    size_t rflags = irq_save();
+
+    cpu_cache &local = cpu_caches[smp::core_local().index];
+
+    for(;;) {
+        if(local.loaded && local.loaded->cnt) {
+            local.alloc_hits++;
+            void *obj = local.loaded->objs[--local.loaded->cnt];
+            irq_restore(rflags);
+            return obj;
+        }
+
+        if(local.previous && local.previous->cnt) {
+            magazine *tmp = local.loaded;
+            local.loaded = local.previous;
+            local.previous = tmp;
+            continue;
+        }
+
+        magazine *full = depot_pop(&depot_full, &depot_full_cnt);
+        if(full == NULL)
+            break;
+
+        if(local.previous)
+            depot_push(&depot_empty, &depot_empty_cnt, local.previous);
+
+        local.previous = local.loaded;
+        local.loaded = full;
+    }
+
+    local.alloc_misses++;
+
+    irq_restore(rflags);
+
+    return slab_alloc();
+}
+
+int cache::free_obj(slab *slab_cur, void *obj) {
+    size_t offset = reinterpret_cast<size_t>(obj) - reinterpret_cast<size_t>(slab_cur->buf);
+    if(reinterpret_cast<uint8_t*>(obj) < slab_cur->buf || offset % stride || offset / stride >= objects_per_slab)
+        return -1;
+
+    if(!smp::percpu_online || smp::core_local().index >= numa::max_cpus)
+        return slab_free(slab_cur, obj);
+
+    size_t rflags = irq_save();
+
+    cpu_cache &local = cpu_caches[smp::core_local().index];
+
+    for(;;) {
+        if(local.loaded && local.loaded->cnt < magazine_size) {
+            local.free_hits++;
+            local.loaded->objs[local.loaded->cnt++] = obj;
+            irq_restore(rflags);
+            return 0;
+        }
+
+        if(local.previous && local.previous->cnt < magazine_size) {
+            magazine *tmp = local.loaded;
+            local.loaded = local.previous;
+            local.previous = tmp;
+            continue;
+        }
+
+        local.free_misses++;
+
+        magazine *empty = depot_pop(&depot_empty, &depot_empty_cnt);
+        if(empty == NULL)
+            empty = alloc_magazine();
+
+        if(empty == NULL) {
+            irq_restore(rflags);
+            return slab_free(slab_cur, obj);
+        }
+
+        if(local.previous)
+            depot_push(&depot_full, &depot_full_cnt, local.previous);
+
+        local.previous = local.loaded;
+        local.loaded = empty;
+    }
+}
+
+cache_stats cache::stats() {
+    cache_stats ret = { 0, 0, 0, 0, depot_full_cnt, depot_empty_cnt };
+
+    for(size_t i = 0; i < numa::max_cpus; i++) {
+        ret.alloc_hits += cpu_caches[i].alloc_hits;
+        ret.alloc_misses += cpu_caches[i].alloc_misses;
+        ret.free_hits += cpu_caches[i].free_hits;
+        ret.free_misses += cpu_caches[i].free_misses;
+    }
+
+    return ret;
+}
+
+void *cache::slab_alloc() {
+    spin_lock(&lock);
+
     slab *slab_cur = NULL;
 
     if(slab_partial) {
@@ -60,9 +297,12 @@ void *cache::alloc_obj() {
         slab_cur = slab_empty;
     }
 
-    if(!slab_cur) {
+    if(!slab_cur)
         slab_cur = alloc_slab(this);
-        slab_empty = slab_cur;
+
+    if(!slab_cur) {
+        spin_release(&lock);
+        return NULL;
     }
 
     void *addr = slab_cur->alloc();
@@ -71,34 +311,136 @@ void *cache::alloc_obj() {
         move_slab(&slab_full, &slab_partial, slab_cur);
     } else if(slab_cur->available_objects == objects_per_slab - 1) {
         move_slab(&slab_partial, &slab_empty, slab_cur); 
+        empty_slabs--;
     }
 
+    active_objects++;
+
+    spin_release(&lock);
+
     return addr;
 }
 
-int cache::free_obj(void *obj) {
-    auto scan_slab = [this, &obj](slab *slab_cur) {
-        if(!slab_cur)
-            return -1;
+int cache::slab_free(slab *slab_cur, void *obj) {
+    spin_lock(&lock);
+    slab_free_locked(slab_cur, obj);
+    spin_release(&lock);
 
-        if(slab_cur->buf <= obj && (slab_cur->buf + object_size * objects_per_slab) > obj) {
-            size_t index = (reinterpret_cast<size_t>(obj) - reinterpret_cast<size_t>(slab_cur->buf)) / object_size;
-            bm_clear(slab_cur->bitmap, index);
-            return 0;
+    return 0;
+}
+
+void cache::slab_free_locked(slab *slab_cur, void *obj) {
+    slab_cur->free(obj);
+
+    if(slab_cur->available_objects == 1) {
+        move_slab(&slab_partial, &slab_full, slab_cur);
+    } else if(slab_cur->available_objects == objects_per_slab) {
+        move_slab(&slab_empty, &slab_partial, slab_cur);
+        empty_slabs++;
+    }
+
+    active_objects--;
+
+    if(empty_slabs > empty_high)
+        reap(empty_low);
+}
+
+bool cache::is_root(slab *slab_cur) {
+    return reinterpret_cast<size_t>(slab_cur) + sizeof(slab) == reinterpret_cast<size_t>(this);
+}
+
+void cache::release_slab(slab *slab_cur) {
+    if(slab_cur->next != NULL)
+        slab_cur->next->last = slab_cur->last;
+    if(slab_cur->last != NULL)
+        slab_cur->last->next = slab_cur->next;
+    if(slab_empty == slab_cur)
+        slab_empty = slab_cur->next;
+
+    if(dtor) {
+        for(size_t i = 0; i < objects_per_slab; i++)
+            dtor(slab_cur->buf + i * stride);
+    }
+
+    size_t base = reinterpret_cast<size_t>(slab_cur) - vmm::high_vma;
+
+    for(size_t i = 0; i < pages_per_slab; i++) {
+        pmm::page *pg = pmm::phys_to_page(base + i * vmm::page_size);
+        pg->flags &= ~pmm::page_slab;
+        pg->owner = NULL;
+    }
+
+    active_slabs--;
+    empty_slabs--;
+
+    pmm::free(base, pages_per_slab);
+}
+
+size_t cache::reap(size_t keep) {
+    size_t ret = 0;
+
+    slab *slab_cur = slab_empty;
+
+    while(slab_cur != NULL && empty_slabs > keep) {
+        slab *next_slab = slab_cur->next;
+
+        if(!is_root(slab_cur)) {
+            release_slab(slab_cur);
+            ret += pages_per_slab;
         }
 
-        return -1;
-    };
+        slab_cur = next_slab;
+    }
+
+    return ret;
+}
 
-    int ret = scan_slab(slab_partial);
-    if(ret == 0)
-        return ret;
+void cache::drain_depot() {
+    for(;;) {
+        magazine *mag = depot_pop(&depot_full, &depot_full_cnt);
+        if(mag == NULL)
+            break;
 
-    ret = scan_slab(slab_full);
-    if(ret == 0)
-        return ret;
+        while(mag->cnt) {
+            void *obj = mag->objs[--mag->cnt];
+            slab_free_locked(reinterpret_cast<slab*>(pmm::phys_to_page(reinterpret_cast<size_t>(obj) - vmm::high_vma)->owner), obj);
+        }
+
+        free_magazine(mag);
+    }
+
+    for(;;) {
+        magazine *mag = depot_pop(&depot_empty, &depot_empty_cnt);
+        if(mag == NULL)
+            break;
+
+        free_magazine(mag);
+    }
+}
+
+size_t cache::shrink() {
+    if(!spin_trylock(&lock))
+        return 0;
+
+    drain_depot();
+
+    size_t ret = reap(0);
+
+    spin_release(&lock);
+
+    return ret;
+}
+
+void cache::set_watermarks(size_t low, size_t high) {
+    spin_lock(&lock);
+
+    empty_low = low;
+    empty_high = high < low ? low : high;
+
+    if(empty_slabs > empty_high)
+        reap(empty_low);
 
-    return -1;
+    spin_release(&lock);
 }
 
 int cache::move_slab(slab **dest_head, slab **src_head, slab *src) {
@@ -112,42 +454,29 @@ int cache::move_slab(slab **dest_head, slab **src_head, slab *src) {
     if(*src_head == src)
         *src_head = src->next;
 
-    if(!*dest_head) {
-        src->last = NULL;
-        src->next = NULL;
-        *dest_head = src; 
-        return 0;
-    }
-
-    slab *node = *dest_head;
-    while(node->next != NULL)
-        node = node->next;
-    node->next = src;
-    src->last = node;
+    push_slab(dest_head, src);
 
     return 0;
 }
 
 void *slab::alloc() {
-    for(size_t i = 0; i < objects_per_slab; i++) {
-        if(!bm_test(bitmap, i)) {
-            bm_set(bitmap, i); 
-            available_objects--;
-            return buf + (i * parent->object_size);
-        }
-    }
+    uint8_t *obj = reinterpret_cast<uint8_t*>(freelist);
+    if(obj == NULL)
+        return NULL;
+
+    freelist = *reinterpret_cast<void**>(obj + parent->link_offset);
+    available_objects--;
 
-    return NULL;
+    return obj;
 }
 
-void slab::free(size_t index) {
-    if(bm_test(bitmap, index)) { 
-        available_objects++;
-        bm_clear(bitmap, index);
-    }
+void slab::free(void *obj) {
+    *reinterpret_cast<void**>(reinterpret_cast<uint8_t*>(obj) + parent->link_offset) = freelist;
+    freelist = obj;
+    available_objects++;
 }
 
-void *alloc(size_t size) {
+static void *raw_alloc(size_t size) {
     if(!size)
         return NULL;
 
@@ -155,46 +484,50 @@ void *alloc(size_t size) {
     if(round_size <= 16)
         round_size = 32;
 
-    cache *cache_cur = cache_root;
+    cache *cache_cur = size_caches[log2(round_size)];
+    if(cache_cur == NULL)
+        return vmalloc(size);
 
-    spin_lock(&slab_lock);
+    return cache_cur->alloc_obj();
+}
 
-    do {
-        if(cache_cur->object_size == round_size) {
-            spin_release(&slab_lock);
-            return cache_cur->alloc_obj();
-        }
-        cache_cur = cache_cur->next;
-    } while(cache_cur != NULL);
+static slab *obj_slab(void *obj) {
+    pmm::page *pg = pmm::phys_to_page(reinterpret_cast<size_t>(obj) - vmm::high_vma);
+    if(pg == NULL || !(pg->flags & pmm::page_slab))
+        return NULL;
 
-    spin_release(&slab_lock);
+    return reinterpret_cast<slab*>(pg->owner);
+}
 
-    return NULL;
+static profile::header *obj_header(void *obj) {
+    return reinterpret_cast<profile::header*>(reinterpret_cast<uint8_t*>(obj) - sizeof(profile::header));
 }
 
-size_t free(void *obj) {
-    if(obj == NULL)
-        return 0;
+static void *tagged_alloc(size_t size, uint64_t site) {
+    if constexpr(!profile::enabled)
+        return raw_alloc(size);
 
-    spin_lock(&slab_lock);
+    if(!size)
+        return NULL;
 
-    cache *cache_cur = cache_root;
+    uint8_t *obj = reinterpret_cast<uint8_t*>(raw_alloc(size + sizeof(profile::header)));
+    if(obj == NULL)
+        return NULL;
 
-    do {
-        if(cache_cur->free_obj(obj)) {
-            spin_release(&slab_lock);
-            return cache_cur->object_size;
-        }
-        cache_cur = cache_cur->next;
-    } while(cache_cur != NULL);
+    profile::header *header = reinterpret_cast<profile::header*>(obj);
+    header->site = site;
+    header->time = rdtsc();
 
-    spin_release(&slab_lock);
+    if(is_vmalloc(obj))
+        profile::record_alloc(site, vmalloc_size(obj));
+    else
+        profile::record_alloc(site, obj_slab(obj)->parent->object_size);
 
-    return 0;
+    return obj + sizeof(profile::header);
 }
 
-void *calloc(size_t cnt) {
-    uint8_t *addr = reinterpret_cast<uint8_t*>(alloc(cnt));
+static void *tagged_calloc(size_t cnt, uint64_t site) {
+    uint8_t *addr = reinterpret_cast<uint8_t*>(tagged_alloc(cnt, site));
     if(addr == NULL) {
         return NULL;
     }
@@ -204,20 +537,87 @@ void *calloc(size_t cnt) {
     return addr; 
 }
 
+void *alloc(size_t size) {
+    return tagged_alloc(size, profile_caller());
+}
+
+size_t free(void *obj) {
+    if(obj == NULL)
+        return 0;
+
+    profile::header header = { 0, 0 };
+
+    if(is_vmalloc(obj)) {
+        if constexpr(profile::enabled) {
+            header = *obj_header(obj);
+            obj = obj_header(obj);
+            profile::record_free(header.site, vmalloc_size(obj), rdtsc() - header.time);
+        }
+
+        return vfree(obj);
+    }
+
+    slab *slab_cur = obj_slab(obj);
+    if(slab_cur == NULL) {
+        print("KMM: free of non slab address {x}\n", reinterpret_cast<size_t>(obj));
+        return 0;
+    }
+
+    cache *cache_cur = slab_cur->parent;
+
+    if(profile::enabled && cache_cur->name == NULL) {
+        header = *obj_header(obj);
+        obj = obj_header(obj);
+    }
+
+    if(cache_cur->free_obj(slab_cur, obj) == -1) {
+        print("KMM: invalid free of {x}\n", reinterpret_cast<size_t>(obj));
+        return 0;
+    }
+
+    if constexpr(profile::enabled)
+        profile::record_free(header.site, cache_cur->object_size, rdtsc() - header.time);
+
+    return cache_cur->object_size;
+}
+
+static size_t obj_size(void *obj) {
+    size_t header_size = profile::enabled ? sizeof(profile::header) : 0;
+
+    if(is_vmalloc(obj))
+        return vmalloc_size(reinterpret_cast<uint8_t*>(obj) - header_size) - header_size;
+
+    slab *slab_cur = obj_slab(obj);
+    if(slab_cur == NULL)
+        return 0;
+
+    return slab_cur->parent->object_size - header_size;
+}
+
+void *calloc(size_t cnt) {
+    return tagged_calloc(cnt, profile_caller());
+}
+
 void *realloc(void *addr, size_t cnt) {
     if(addr == NULL) 
         return NULL;
 
-    size_t alloc_size = free(addr);
+    size_t alloc_size = obj_size(addr);
+    if(cnt <= alloc_size && cnt > alloc_size / 2)
+        return addr;
+
+    void *new_addr = tagged_alloc(cnt, profile_caller());
+    if(new_addr == NULL)
+        return NULL;
 
-    void *new_addr = alloc(cnt);
-    
     size_t bytes_to_copy = cnt;
-    if(cnt < alloc_size) 
+    if(alloc_size < cnt) 
         bytes_to_copy = alloc_size;
 
     memcpy8(reinterpret_cast<uint8_t*>(new_addr), reinterpret_cast<uint8_t*>(addr), bytes_to_copy);
 
+    free(addr);
+
     return new_addr;
 }
 
@@ -225,17 +625,148 @@ void *recalloc(void *addr, size_t cnt) {
     if(addr == NULL) 
         return NULL;
 
-    size_t alloc_size = free(addr);
+    size_t alloc_size = obj_size(addr);
+
+    void *new_addr = tagged_calloc(cnt, profile_caller());
+    if(new_addr == NULL)
+        return NULL;
 
-    void *new_addr = calloc(cnt);
-    
     size_t bytes_to_copy = cnt;
-    if(cnt < alloc_size) 
+    if(alloc_size < cnt) 
         bytes_to_copy = alloc_size;
 
     memcpy8(reinterpret_cast<uint8_t*>(new_addr), reinterpret_cast<uint8_t*>(addr), bytes_to_copy);
 
+    free(addr);
+
     return new_addr;
 }
 
+size_t shrink() {
+    size_t ret = 0;
+
+    for(cache *cache_cur = cache_root; cache_cur != NULL; cache_cur = cache_cur->next)
+        ret += cache_cur->shrink();
+
+    return ret;
+}
+
+void print_stats() {
+    for(cache *cache_cur = cache_root; cache_cur != NULL; cache_cur = cache_cur->next) {
+        cache_stats stats = cache_cur->stats();
+
+        print("KMM: cache {} size {}: objects {} slabs {} ({} empty) alloc hit/miss {}/{} free hit/miss {}/{} depot full/empty {}/{}\n",
+                cache_cur->name ? cache_cur->name : "generic", cache_cur->object_size, cache_cur->active_objects, cache_cur->active_slabs, cache_cur->empty_slabs,
+                stats.alloc_hits, stats.alloc_misses, stats.free_hits, stats.free_misses, stats.depot_full, stats.depot_empty);
+    }
+}
+
+
+// fresh slabs hand out their objects in order, so objs[i * objects_per_slab + j] is object j of the i'th slab
+static void bench_fill(cache *cache_cur, void **objs, size_t cnt) {
+    for(size_t i = 0; i < cnt; i++)
+        objs[i] = cache_cur->alloc_obj();
+}
+
+static void bench_drain(cache *cache_cur, void **objs, size_t cnt) {
+    for(size_t i = 0; i < cnt; i++)
+        free(objs[i]);
+
+    cache_cur->shrink();
+}
+
+// the first objects of every slab sit at the same page offset unless the slabs are colored, so walking
+// them over more slabs than the cache has ways keeps evicting the same sets
+static uint64_t bench_color(cache *cache_cur, void **objs) {
+    bench_fill(cache_cur, objs, slab_bench_slabs * objects_per_slab);
+
+    uint64_t start = rdtsc();
+
+    for(size_t pass = 0; pass < slab_bench_passes; pass++) {
+        for(size_t j = 0; j < slab_bench_hot; j++) {
+            for(size_t i = 0; i < slab_bench_slabs; i++)
+                *reinterpret_cast<volatile uint64_t*>(objs[i * objects_per_slab + j]) = pass;
+        }
+    }
+
+    uint64_t ret = (rdtsc() - start) / (slab_bench_passes * slab_bench_hot * slab_bench_slabs);
+
+    bench_drain(cache_cur, objs, slab_bench_slabs * objects_per_slab);
+
+    return ret;
+}
+
+// objects that straddle a cache line cost two lines when both ends are written
+static uint64_t bench_align(cache *cache_cur, void **objs) {
+    size_t cnt = slab_bench_hot * objects_per_slab;
+
+    bench_fill(cache_cur, objs, cnt);
+
+    uint64_t start = rdtsc();
+
+    for(size_t pass = 0; pass < slab_bench_passes; pass++) {
+        for(size_t i = 0; i < cnt; i++) {
+            uint8_t *obj = reinterpret_cast<uint8_t*>(objs[i]);
+            *reinterpret_cast<volatile uint64_t*>(obj) = pass;
+            *reinterpret_cast<volatile uint64_t*>(obj + cache_cur->object_size - sizeof(uint64_t)) = pass;
+        }
+    }
+
+    uint64_t ret = (rdtsc() - start) / (slab_bench_passes * cnt);
+
+    bench_drain(cache_cur, objs, cnt);
+
+    return ret;
+}
+
+// built with SLAB_BENCH=1, times an alloc/free pair through the magazines against the slab freelist,
+// then the cost of touching objects from colored and uncolored slabs and from packed and aligned caches
+void slab_bench() {
+    if constexpr(!slab_bench_enabled)
+        return;
+
+    void **objs = reinterpret_cast<void**>(alloc(slab_bench_slabs * objects_per_slab * sizeof(void*)));
+    if(objs == NULL)
+        return;
+
+    cache *hot = create_cache("bench hot", 64);
+
+    free(hot->alloc_obj());
+
+    uint64_t start = rdtsc();
+    for(size_t i = 0; i < slab_bench_rounds; i++)
+        free(hot->alloc_obj());
+    uint64_t magazine_cycles = (rdtsc() - start) / slab_bench_rounds;
+
+    start = rdtsc();
+    for(size_t i = 0; i < slab_bench_rounds; i++) {
+        void *obj = hot->slab_alloc();
+        hot->slab_free(obj_slab(obj), obj);
+    }
+    uint64_t freelist_cycles = (rdtsc() - start) / slab_bench_rounds;
+
+    print("SLAB: {} cycles per alloc/free through the magazines, {} through the slab freelist\n", magazine_cycles, freelist_cycles);
+
+    cache *colored = create_cache("bench colored", 64);
+    cache *plain = create_cache("bench plain", 64);
+
+    plain->color_step = 0;
+    plain->color_max = 0;
+
+    uint64_t colored_cycles = bench_color(colored, objs);
+    uint64_t plain_cycles = bench_color(plain, objs);
+
+    print("SLAB: {} cycles per write across {} colored slabs, {} without coloring\n", colored_cycles, slab_bench_slabs, plain_cycles);
+
+    cache *packed = create_cache("bench packed", 48);
+    cache *aligned = create_cache("bench aligned", 48, 0, cache_cacheline_aligned);
+
+    uint64_t aligned_cycles = bench_align(aligned, objs);
+    uint64_t packed_cycles = bench_align(packed, objs);
+
+    print("SLAB: {} cycles per object written with cacheline_aligned, {} packed\n", aligned_cycles, packed_cycles);
+
+    free(objs);
+}
+
 }
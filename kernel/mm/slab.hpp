@@ -8,55 +8,181 @@ namespace kmm {
 constexpr size_t objects_per_slab = 256;
 constexpr size_t largest_cache_size = 32768;
 
+constexpr size_t magazine_size = 30;
+
+constexpr size_t cacheline_size = 64;
+
+constexpr size_t cache_cacheline_aligned = (1 << 0);
+
+constexpr size_t slab_empty_low = 1;
+constexpr size_t slab_empty_high = 4;
+
+#ifdef SLAB_BENCH
+constexpr bool slab_bench_enabled = true;
+#else
+constexpr bool slab_bench_enabled = false;
+#endif
+
+constexpr size_t slab_bench_rounds = 100000;
+constexpr size_t slab_bench_slabs = 64;
+constexpr size_t slab_bench_hot = 4;
+constexpr size_t slab_bench_passes = 1000;
+
 struct cache;
 struct slab;
 
+struct magazine {
+    size_t cnt;
+    void *objs[magazine_size];
+    magazine *next;
+};
+
+struct alignas(64) cpu_cache {
+    magazine *loaded;
+    magazine *previous;
+
+    size_t alloc_hits;
+    size_t alloc_misses;
+    size_t free_hits;
+    size_t free_misses;
+};
+
+struct cache_stats {
+    size_t alloc_hits;
+    size_t alloc_misses;
+    size_t free_hits;
+    size_t free_misses;
+    size_t depot_full;
+    size_t depot_empty;
+};
+
 struct cache {
-    cache(const char *name, size_t object_size, size_t flags);
+    cache(const char *name, size_t flags, size_t object_size, size_t align = 0, void (*ctor)(void*) = NULL, void (*dtor)(void*) = NULL);
     cache() = default;
 
     void *alloc_obj();
-    int free_obj(void *obj);
+    int free_obj(slab *slab_cur, void *obj);
 
     int move_slab(slab **dest_head, slab **src_head, slab *src);
 
+    cache_stats stats();
+
+    size_t shrink();
+    void set_watermarks(size_t low, size_t high);
+
     const char *name;
     size_t flags;
 
     size_t object_size;
+    size_t align;
+    size_t stride;
+    size_t link_offset;
     size_t active_objects;
     size_t active_slabs;
+    size_t empty_slabs;
     size_t pages_per_slab;
 
+    size_t empty_low;
+    size_t empty_high;
+
+    size_t color_step;
+    size_t color_max;
+    size_t color_next;
+
+    void (*ctor)(void*);
+    void (*dtor)(void*);
+
     slab *slab_empty;
     slab *slab_partial; 
     slab *slab_full;
 
+    cpu_cache *cpu_caches;
+
+    magazine *depot_full;
+    magazine *depot_empty;
+    size_t depot_full_cnt;
+    size_t depot_empty_cnt;
+
     cache *next;
     cache *last;
+
+    size_t lock;
+    size_t depot_lock;
+private:
+    friend void slab_bench();
+
+    void *slab_alloc();
+    int slab_free(slab *slab_cur, void *obj);
+    void slab_free_locked(slab *slab_cur, void *obj);
+
+    magazine *depot_pop(magazine **head, size_t *cnt);
+    void depot_push(magazine **head, size_t *cnt, magazine *mag);
+    void drain_depot();
+
+    bool is_root(slab *slab_cur);
+    void release_slab(slab *slab_cur);
+    size_t reap(size_t keep);
 };
 
 struct slab {
     void *alloc();
-    void free(size_t index);
+    void free(void *obj);
 
     size_t available_objects;
+    size_t color;
     cache *parent;
 
     uint8_t *buf;
-    uint8_t *bitmap;
+    void *freelist;
 
     slab *next;
     slab *last;
 };
 
-void *alloc(size_t cnt);
-void *calloc(size_t cnt);
+profile_noinline void *alloc(size_t cnt);
+profile_noinline void *calloc(size_t cnt);
 
 size_t free(void *obj); 
 
-void *realloc(void *addr, size_t cnt);
-void *recalloc(void *addr, size_t cnt);
+profile_noinline void *realloc(void *addr, size_t cnt);
+profile_noinline void *recalloc(void *addr, size_t cnt);
+
+size_t shrink();
+void print_stats();
+void slab_bench();
+
+// ctor runs once per object when its slab is created and dtor when the slab is released,
+// so objects must be handed back to free in their constructed state
+cache *create_cache(const char *name, size_t object_size, size_t align = 0, size_t flags = 0, void (*ctor)(void*) = NULL, void (*dtor)(void*) = NULL);
+
+template <typename T>
+class object_cache {
+public:
+    object_cache(const char *name, size_t flags = 0, void (*ctor)(void*) = NULL, void (*dtor)(void*) = NULL) :
+        name(name), flags(flags), ctor(ctor), dtor(dtor), impl(NULL), lock(0) { }
+
+    T *alloc() {
+        if(impl == NULL) {
+            spin_lock(&lock);
+            if(impl == NULL)
+                impl = create_cache(name, sizeof(T), alignof(T), flags, ctor, dtor);
+            spin_release(&lock);
+        }
+
+        return reinterpret_cast<T*>(impl->alloc_obj());
+    }
+
+    void free(T *obj) { kmm::free(obj); }
+private:
+    const char *name;
+    size_t flags;
+
+    void (*ctor)(void*);
+    void (*dtor)(void*);
+
+    cache *volatile impl;
+    size_t lock;
+};
 
 }
 
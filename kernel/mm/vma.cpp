@@ -0,0 +1,535 @@
+#include <mm/vma.hpp>
+#include <mm/slab.hpp>
+#include <mm/shm.hpp>
+
+namespace mm {
+
+static kmm::object_cache<vma> vma_cache("vma");
+
+// every vma mapping a shared memory object keeps it alive
+static void file_ref(vfs::node *file) {
+    if(file != NULL && is_shm(file))
+        shm_ref(file);
+}
+
+static void file_unref(vfs::node *file) {
+    if(file != NULL && is_shm(file))
+        shm_unref(file);
+}
+
+static uint64_t subtree_gap(vma *node) {
+    return node ? node->subtree_gap : 0;
+}
+
+void vma_tree::refresh(vma *node) {
+    uint64_t gap = node->gap;
+
+    if(subtree_gap(node->left) > gap)
+        gap = subtree_gap(node->left);
+    if(subtree_gap(node->right) > gap)
+        gap = subtree_gap(node->right);
+
+    node->subtree_gap = gap;
+}
+
+void vma_tree::propagate(vma *node) {
+    for(; node != NULL; node = node->parent)
+        refresh(node);
+}
+
+// vma containing addr
+vma *vma_tree::find(uint64_t addr) {
+    vma *node = root;
+
+    while(node != NULL) {
+        if(addr < node->base) {
+            node = node->left;
+        } else if(addr >= node->end()) {
+            node = node->right;
+        } else {
+            return node;
+        }
+    }
+
+    return NULL;
+}
+
+// first vma ending above addr
+vma *vma_tree::lower_bound(uint64_t addr) {
+    vma *ret = NULL;
+
+    for(vma *node = root; node != NULL;) {
+        if(node->end() > addr) {
+            ret = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+
+    return ret;
+}
+
+vma *vma_tree::first() {
+    vma *node = root;
+
+    while(node != NULL && node->left != NULL)
+        node = node->left;
+
+    return node;
+}
+
+vma *vma_tree::last() {
+    vma *node = root;
+
+    while(node != NULL && node->right != NULL)
+        node = node->right;
+
+    return node;
+}
+
+vma *vma_tree::next(vma *node) {
+    if(node->right != NULL) {
+        node = node->right;
+        while(node->left != NULL)
+            node = node->left;
+        return node;
+    }
+
+    while(node->parent != NULL && node == node->parent->right)
+        node = node->parent;
+
+    return node->parent;
+}
+
+vma *vma_tree::prev(vma *node) {
+    if(node->left != NULL) {
+        node = node->left;
+        while(node->right != NULL)
+            node = node->right;
+        return node;
+    }
+
+    while(node->parent != NULL && node == node->parent->left)
+        node = node->parent;
+
+    return node->parent;
+}
+
+void vma_tree::rotate_left(vma *node) {
+    vma *child = node->right;
+
+    node->right = child->left;
+    if(child->left != NULL)
+        child->left->parent = node;
+
+    child->parent = node->parent;
+
+    if(node->parent == NULL) {
+        root = child;
+    } else if(node == node->parent->left) {
+        node->parent->left = child;
+    } else {
+        node->parent->right = child;
+    }
+
+    child->left = node;
+    node->parent = child;
+
+    refresh(node);
+    refresh(child);
+}
+
+void vma_tree::rotate_right(vma *node) {
+    vma *child = node->left;
+
+    node->left = child->right;
+    if(child->right != NULL)
+        child->right->parent = node;
+
+    child->parent = node->parent;
+
+    if(node->parent == NULL) {
+        root = child;
+    } else if(node == node->parent->right) {
+        node->parent->right = child;
+    } else {
+        node->parent->left = child;
+    }
+
+    child->right = node;
+    node->parent = child;
+
+    refresh(node);
+    refresh(child);
+}
+
+void vma_tree::insert_fixup(vma *node) {
+    while(node->parent != NULL && node->parent->red) {
+        vma *parent = node->parent;
+        vma *grand = parent->parent;
+
+        if(parent == grand->left) {
+            vma *uncle = grand->right;
+
+            if(uncle != NULL && uncle->red) {
+                parent->red = false;
+                uncle->red = false;
+                grand->red = true;
+                node = grand;
+                continue;
+            }
+
+            if(node == parent->right) {
+                node = parent;
+                rotate_left(node);
+                parent = node->parent;
+            }
+
+            parent->red = false;
+            grand->red = true;
+            rotate_right(grand);
+        } else {
+            vma *uncle = grand->left;
+
+            if(uncle != NULL && uncle->red) {
+                parent->red = false;
+                uncle->red = false;
+                grand->red = true;
+                node = grand;
+                continue;
+            }
+
+            if(node == parent->left) {
+                node = parent;
+                rotate_right(node);
+                parent = node->parent;
+            }
+
+            parent->red = false;
+            grand->red = true;
+            rotate_left(grand);
+        }
+    }
+
+    root->red = false;
+}
+
+void vma_tree::erase_fixup(vma *node, vma *parent) {
+    auto is_red = [](vma *node) { return node != NULL && node->red; };
+
+    while(node != root && !is_red(node)) {
+        if(node == parent->left) {
+            vma *sibling = parent->right;
+
+            if(sibling->red) {
+                sibling->red = false;
+                parent->red = true;
+                rotate_left(parent);
+                sibling = parent->right;
+            }
+
+            if(!is_red(sibling->left) && !is_red(sibling->right)) {
+                sibling->red = true;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+
+            if(!is_red(sibling->right)) {
+                sibling->left->red = false;
+                sibling->red = true;
+                rotate_right(sibling);
+                sibling = parent->right;
+            }
+
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->right->red = false;
+            rotate_left(parent);
+        } else {
+            vma *sibling = parent->left;
+
+            if(sibling->red) {
+                sibling->red = false;
+                parent->red = true;
+                rotate_right(parent);
+                sibling = parent->left;
+            }
+
+            if(!is_red(sibling->left) && !is_red(sibling->right)) {
+                sibling->red = true;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+
+            if(!is_red(sibling->left)) {
+                sibling->right->red = false;
+                sibling->red = true;
+                rotate_left(sibling);
+                sibling = parent->left;
+            }
+
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->left->red = false;
+            rotate_right(parent);
+        }
+
+        node = root;
+    }
+
+    if(node != NULL)
+        node->red = false;
+}
+
+void vma_tree::link(vma *node) {
+    vma *parent = NULL;
+    vma **slot = &root;
+
+    while(*slot != NULL) {
+        parent = *slot;
+        slot = (node->base < parent->base) ? &parent->left : &parent->right;
+    }
+
+    node->left = NULL;
+    node->right = NULL;
+    node->parent = parent;
+    node->red = true;
+    *slot = node;
+
+    vma *pred = prev(node);
+    node->gap = node->base - (pred ? pred->end() : 0);
+
+    propagate(node);
+    insert_fixup(node);
+
+    vma *succ = next(node);
+    if(succ != NULL) {
+        succ->gap = succ->base - node->end();
+        propagate(succ);
+    }
+
+    cnt++;
+}
+
+void vma_tree::erase(vma *node) {
+    vma *pred = prev(node);
+    vma *succ = next(node);
+
+    auto transplant = [&](vma *old, vma *replacement) {
+        if(old->parent == NULL) {
+            root = replacement;
+        } else if(old == old->parent->left) {
+            old->parent->left = replacement;
+        } else {
+            old->parent->right = replacement;
+        }
+
+        if(replacement != NULL)
+            replacement->parent = old->parent;
+    };
+
+    vma *child, *parent;
+    bool removed_red = node->red;
+
+    if(node->left == NULL) {
+        child = node->right;
+        parent = node->parent;
+        transplant(node, node->right);
+    } else if(node->right == NULL) {
+        child = node->left;
+        parent = node->parent;
+        transplant(node, node->left);
+    } else {
+        removed_red = succ->red;
+        child = succ->right;
+
+        if(succ->parent == node) {
+            parent = succ;
+        } else {
+            parent = succ->parent;
+            transplant(succ, succ->right);
+            succ->right = node->right;
+            succ->right->parent = succ;
+        }
+
+        transplant(node, succ);
+        succ->left = node->left;
+        succ->left->parent = succ;
+        succ->red = node->red;
+    }
+
+    propagate(parent);
+
+    if(!removed_red)
+        erase_fixup(child, parent);
+
+    if(succ != NULL) {
+        succ->gap = succ->base - (pred ? pred->end() : 0);
+        propagate(succ);
+    }
+
+    cnt--;
+    file_unref(node->file);
+    vma_cache.free(node);
+}
+
+// moves the bounds of node without changing its position in the tree
+void vma_tree::resize(vma *node, uint64_t base, size_t length) {
+    node->base = base;
+    node->length = length;
+
+    vma *pred = prev(node);
+    node->gap = base - (pred ? pred->end() : 0);
+    propagate(node);
+
+    vma *succ = next(node);
+    if(succ != NULL) {
+        succ->gap = succ->base - node->end();
+        propagate(succ);
+    }
+}
+
+// the range must be free, it is merged into neighbours that it touches and matches
+vma *vma_tree::insert(uint64_t base, size_t length, int prot, int flags, vfs::node *file, ssize_t offset) {
+    vma *succ = lower_bound(base);
+    vma *pred = succ ? prev(succ) : last();
+
+    auto same = [&](vma *node) {
+        return node->prot == prot && node->flags == flags && node->file == file;
+    };
+
+    bool pred_merge = pred != NULL && pred->end() == base && same(pred) && (file == NULL || pred->offset + (ssize_t)pred->length == offset);
+    bool succ_merge = succ != NULL && succ->base == base + length && same(succ) && (file == NULL || offset + (ssize_t)length == succ->offset);
+
+    if(pred_merge && succ_merge) {
+        uint64_t end = succ->end();
+        erase(succ);
+        resize(pred, pred->base, end - pred->base);
+        return pred;
+    }
+
+    if(pred_merge) {
+        resize(pred, pred->base, pred->length + length);
+        return pred;
+    }
+
+    if(succ_merge) {
+        succ->offset = offset;
+        resize(succ, base, succ->end() - base);
+        return succ;
+    }
+
+    vma *node = vma_cache.alloc();
+
+    node->base = base;
+    node->length = length;
+    node->prot = prot;
+    node->flags = flags;
+    node->file = file;
+    node->offset = offset;
+
+    file_ref(file);
+    link(node);
+
+    return node;
+}
+
+// drops [base, base + length), vmas straddling either end are trimmed or split
+void vma_tree::remove(uint64_t base, size_t length) {
+    uint64_t end = base + length;
+
+    for(vma *cur = lower_bound(base), *next_vma; cur != NULL && cur->base < end; cur = next_vma) {
+        next_vma = next(cur);
+
+        uint64_t cur_end = cur->end();
+
+        if(cur->base < base && cur_end > end) {
+            ssize_t offset = cur->offset + (end - cur->base);
+
+            resize(cur, cur->base, base - cur->base);
+            insert(end, cur_end - end, cur->prot, cur->flags, cur->file, offset);
+
+            return;
+        } else if(cur->base < base) {
+            resize(cur, cur->base, base - cur->base);
+        } else if(cur_end > end) {
+            cur->offset += end - cur->base;
+            resize(cur, end, cur_end - end);
+        } else {
+            erase(cur);
+        }
+    }
+}
+
+// frees every vma, bottom up so no rebalancing is needed
+void vma_tree::clear() {
+    vma *node = root;
+
+    while(node != NULL) {
+        if(node->left != NULL) {
+            node = node->left;
+        } else if(node->right != NULL) {
+            node = node->right;
+        } else {
+            vma *parent = node->parent;
+
+            if(parent != NULL) {
+                if(parent->left == node) {
+                    parent->left = NULL;
+                } else {
+                    parent->right = NULL;
+                }
+            }
+
+            file_unref(node->file);
+            vma_cache.free(node);
+            node = parent;
+        }
+    }
+
+    root = NULL;
+    cnt = 0;
+}
+
+// lowest aligned start of length bytes inside the gap in front of a vma of this subtree, subtrees whose
+// largest gap is below need (length plus the worst case alignment padding) are skipped
+uint64_t vma_tree::gap_search(vma *node, size_t need, size_t length, size_t align, uint64_t floor) {
+    if(node == NULL || node->subtree_gap < need)
+        return -1;
+
+    uint64_t ret = gap_search(node->left, need, length, align, floor);
+    if(ret != -1ull)
+        return ret;
+
+    if(node->gap >= need) {
+        uint64_t start = node->base - node->gap;
+        start = align_up(start < floor ? floor : start, align);
+
+        if(start + length <= node->base)
+            return start;
+    }
+
+    return gap_search(node->right, need, length, align, floor);
+}
+
+// align is a power of two and at least vma_granularity, returns -1 when [floor, limit) has no room
+uint64_t vma_tree::find_gap(size_t length, size_t align, uint64_t floor, uint64_t limit) {
+    uint64_t ret = gap_search(root, length + align - vma_granularity, length, align, floor);
+    if(ret != -1ull)
+        return ret + length <= limit ? ret : -1;
+
+    vma *tail = last();
+
+    uint64_t start = tail ? tail->end() : 0;
+    start = align_up(start < floor ? floor : start, align);
+
+    if(start + length > limit)
+        return -1;
+
+    return start;
+}
+
+}
@@ -0,0 +1,77 @@
+#ifndef VMA_HPP_
+#define VMA_HPP_
+
+#include <memutils.hpp>
+#include <cstdint>
+#include <cstddef>
+
+namespace vfs {
+
+class node;
+
+}
+
+namespace mm {
+
+constexpr size_t vma_granularity = 0x1000;
+
+// a reserved range of a page map, pages are only backed once they are touched
+struct vma {
+    uint64_t base;
+    size_t length;
+    int prot;
+    int flags;
+
+    vfs::node *file; // backing file, NULL when anonymous
+    ssize_t offset;
+
+    vma *left;
+    vma *right;
+    vma *parent;
+    bool red;
+
+    uint64_t gap; // free space between the previous vma (or address 0) and base
+    uint64_t subtree_gap; // largest gap in this subtree
+
+    uint64_t end() const { return base + length; }
+};
+
+// red-black tree of non-overlapping vmas ordered by base, augmented with the largest free gap of every subtree
+struct vma_tree {
+    vma_tree() : root(NULL), cnt(0) { }
+
+    vma *find(uint64_t addr);
+    vma *lower_bound(uint64_t addr);
+    vma *first();
+    vma *last();
+
+    static vma *next(vma *node);
+    static vma *prev(vma *node);
+
+    vma *insert(uint64_t base, size_t length, int prot, int flags, vfs::node *file, ssize_t offset);
+    void remove(uint64_t base, size_t length);
+    void clear();
+
+    uint64_t find_gap(size_t length, size_t align, uint64_t floor, uint64_t limit);
+
+    vma *root;
+    size_t cnt;
+private:
+    void link(vma *node);
+    void erase(vma *node);
+    void resize(vma *node, uint64_t base, size_t length);
+
+    void rotate_left(vma *node);
+    void rotate_right(vma *node);
+    void insert_fixup(vma *node);
+    void erase_fixup(vma *node, vma *parent);
+
+    void refresh(vma *node);
+    void propagate(vma *node);
+
+    uint64_t gap_search(vma *node, size_t need, size_t length, size_t align, uint64_t floor);
+};
+
+}
+
+#endif
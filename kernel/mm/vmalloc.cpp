@@ -0,0 +1,136 @@
+#include <mm/vmalloc.hpp>
+#include <mm/slab.hpp>
+#include <cpu.hpp>
+
+namespace kmm {
+
+static vm_area *area_root = NULL;
+static size_t vmalloc_lock = 0;
+
+static vm_area *find_area(size_t base) {
+    for(vm_area *area = area_root; area != NULL; area = area->next) {
+        if(area->base == base)
+            return area;
+        if(area->base > base)
+            break;
+    }
+
+    return NULL;
+}
+
+void *vmalloc(size_t size) {
+    if(!size || vmm::kernel_mapping == NULL)
+        return NULL;
+
+    size_t page_cnt = div_roundup(size, vmm::page_size);
+    size_t limit = vmm::high_vma + vmalloc_offset + vmalloc_length;
+
+    vm_area *area = new vm_area;
+
+    spin_lock(&vmalloc_lock);
+
+    size_t base = vmm::high_vma + vmalloc_offset;
+    vm_area *prev = NULL;
+
+    for(vm_area *node = area_root; node != NULL; prev = node, node = node->next) {
+        if(base + (page_cnt + 1) * vmm::page_size <= node->base)
+            break;
+        base = node->base + (node->page_cnt + 1) * vmm::page_size;
+    }
+
+    if(base + (page_cnt + 1) * vmm::page_size > limit) {
+        spin_release(&vmalloc_lock);
+        delete area;
+        print("KMM: vmalloc area exhausted\n");
+        return NULL;
+    }
+
+    area->base = base;
+    area->page_cnt = page_cnt;
+    area->last = prev;
+
+    if(prev == NULL) {
+        area->next = area_root;
+        area_root = area;
+    } else {
+        area->next = prev->next;
+        prev->next = area;
+    }
+
+    if(area->next != NULL)
+        area->next->last = area;
+
+    spin_release(&vmalloc_lock);
+
+    // vfree copes with a partly mapped area, it releases what was mapped along with the range
+    if(vmm::kernel_mapping->map_range(base, page_cnt, 0x3 | (1 << 8), -1) == -1) {
+        vfree(reinterpret_cast<void*>(base));
+        return NULL;
+    }
+
+    return reinterpret_cast<void*>(base);
+}
+
+size_t vfree(void *addr) {
+    size_t base = reinterpret_cast<size_t>(addr);
+
+    spin_lock(&vmalloc_lock);
+    vm_area *area = find_area(base);
+    spin_release(&vmalloc_lock);
+
+    if(area == NULL) {
+        print("KMM: vfree of unknown area {x}\n", base);
+        return 0;
+    }
+
+    size_t page_cnt = area->page_cnt;
+
+    // frames are only released once every cpu has dropped its translation for them
+    uint64_t batch[vfree_batch];
+    size_t batch_cnt = 0;
+
+    for(size_t i = 0; i < page_cnt; i++) {
+        uint64_t paddr = vmm::kernel_mapping->unmap_page(base + i * vmm::page_size);
+        if(paddr != -1ull)
+            batch[batch_cnt++] = paddr;
+
+        if(batch_cnt == vfree_batch || (i == page_cnt - 1 && batch_cnt)) {
+            vmm::kernel_mapping->shootdown();
+
+            for(size_t j = 0; j < batch_cnt; j++)
+                pmm::free(batch[j], 1);
+
+            batch_cnt = 0;
+        }
+    }
+
+    spin_lock(&vmalloc_lock);
+
+    if(area->last != NULL) {
+        area->last->next = area->next;
+    } else {
+        area_root = area->next;
+    }
+
+    if(area->next != NULL)
+        area->next->last = area->last;
+
+    spin_release(&vmalloc_lock);
+
+    delete area;
+
+    return page_cnt * vmm::page_size;
+}
+
+size_t vmalloc_size(void *addr) {
+    spin_lock(&vmalloc_lock);
+
+    vm_area *area = find_area(reinterpret_cast<size_t>(addr));
+    size_t size = area ? area->page_cnt * vmm::page_size : 0;
+
+    spin_release(&vmalloc_lock);
+
+    return size;
+}
+
+}
@@ -0,0 +1,32 @@
+#ifndef VMALLOC_HPP_
+#define VMALLOC_HPP_
+
+#include <mm/vmm.hpp>
+
+namespace kmm {
+
+// vmm::init moves the window above the direct map once that grows past it
+inline size_t vmalloc_offset = 0x4000000000;
+constexpr size_t vmalloc_length = 0x4000000000;
+constexpr size_t vfree_batch = 64;
+
+struct vm_area {
+    size_t base;
+    size_t page_cnt;
+
+    vm_area *next;
+    vm_area *last;
+};
+
+inline bool is_vmalloc(void *addr) {
+    size_t base = reinterpret_cast<size_t>(addr);
+    return base >= vmm::high_vma + vmalloc_offset && base < vmm::high_vma + vmalloc_offset + vmalloc_length;
+}
+
+void *vmalloc(size_t size);
+size_t vfree(void *addr);
+size_t vmalloc_size(void *addr);
+
+}
+
+#endif
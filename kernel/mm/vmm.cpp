@@ -1,477 +1,724 @@
 #include <mm/pmm.hpp>
+#include <mm/numa.hpp>
+#include <mm/vmalloc.hpp>
 #include <sched/smp.hpp>
+#include <int/apic.hpp>
 
 namespace vmm {
 
-pml5_table::virtual_address::virtual_address(uint64_t *pml5_raw, uint64_t vaddr, uint64_t paddr) :
-    _pml5e(NULL),
-    _pml4e(NULL),
-    _pml3e(NULL),
-    _pml2e(NULL),
-    _pml1e(NULL),
-    vaddr(vaddr),
-    paddr(paddr),
-    pml5_raw(pml5_raw) {
-    compute_indices();
-}
-
-pml4_table::virtual_address::virtual_address(uint64_t *pml4_raw, uint64_t vaddr, uint64_t paddr) : 
-    _pml4e(NULL),
-    _pml3e(NULL),
-    _pml2e(NULL),
-    _pml1e(NULL),
-    vaddr(vaddr),
-    paddr(paddr),
-    pml4_raw(pml4_raw) {
-    compute_indices();
-}
-
-pml5_table::virtual_address::virtual_address(uint64_t *pml5_raw, uint64_t vaddr) :
-    _pml5e(NULL),
-    _pml4e(NULL),
-    _pml3e(NULL),
-    _pml2e(NULL),
-    _pml1e(NULL),
-    vaddr(vaddr),
-    paddr(0),
-    pml5_raw(pml5_raw) {
-    compute_indices();
-
-    if(!pml5_raw[pml5_idx]) 
-        return;
+// canonical upper half addresses have the sign bit set with either paging depth, 0xffff800000000000 is only the
+// start of it with 4 levels
+static bool is_upper_half(uint64_t vaddr) {
+    return vaddr >> 63;
+}
 
-    _pml5e = new pml5e(&pml5_raw[pml5_idx]);
-    if(!_pml5e->is_present())
-        return;
+// entry for vaddr at level, missing tables are created with table_flags (or NULL is returned when it is 0),
+// a huge page above level or running out of memory also gives NULL
+template <size_t levels>
+uint64_t *page_table<levels>::walk(uint64_t vaddr, size_t level, uint64_t table_flags) {
+    uint64_t *table = highest_raw;
 
-    pml4_raw = reinterpret_cast<uint64_t*>((pml5_raw[pml5_idx] & ~(0xfff)) + high_vma);
+    for(size_t i = levels; i > level; i--) {
+        uint64_t &entry = table[level_index(vaddr, i)];
 
-    if(!pml4_raw[pml4_idx])
-        return;
+        if(!pte_is_present(entry)) {
+            if(!table_flags)
+                return NULL;
 
-    _pml4e = new pml4e(&pml4_raw[pml4_idx]);
-    if(!_pml4e->is_present()) 
-        return;
+            size_t base = pmm::calloc(1);
+            if(base == -1ull)
+                return NULL;
 
-    pml3_raw = reinterpret_cast<uint64_t*>((pml4_raw[pml4_idx] & ~(0xfff)) + high_vma);
+            entry = base | table_flags;
+        } else if(i <= 3 && pte_is_huge(entry)) {
+            return NULL;
+        } else {
+            entry |= table_flags & pte_user;
+        }
 
-    if(!pml3_raw[pml3_idx])
-        return;
+        table = pte_table(entry);
+    }
 
-    _pml3e = new pml3e(&pml3_raw[pml3_idx]);
-    if(!_pml3e->is_present() || _pml3e->is_huge())
-        return;
+    return &table[level_index(vaddr, level)];
+}
 
-    pml2_raw = reinterpret_cast<uint64_t*>((pml3_raw[pml3_idx] & ~(0xfff)) + high_vma);
+// present leaf entry mapping vaddr, level is set to where it was found (or to where the walk hit a hole)
+template <size_t levels>
+uint64_t *page_table<levels>::lookup(uint64_t vaddr, size_t *level) {
+    uint64_t *table = highest_raw;
 
-    if(!pml2_raw[pml2_idx])
-        return;
+    for(size_t i = levels; i > 1; i--) {
+        uint64_t *entry = &table[level_index(vaddr, i)];
 
-    _pml2e = new pml2e(&pml2_raw[pml2_idx]);
-    if(!_pml2e->is_present() || _pml2e->is_huge())
-        return;
+        if(!pte_is_present(*entry)) {
+            *level = i;
+            return NULL;
+        }
 
-    pml1_raw = reinterpret_cast<uint64_t*>((pml2_raw[pml2_idx] & ~(0xfff)) + high_vma);
+        if(i <= 3 && pte_is_huge(*entry)) {
+            *level = i;
+            return entry;
+        }
 
-    if(!pml1_raw[pml1_idx])
-        return;
+        table = pte_table(*entry);
+    }
 
-    _pml1e = new pml1e(&pml1_raw[pml1_idx]);
-}
+    uint64_t *entry = &table[level_index(vaddr, 1)];
 
-pml4_table::virtual_address::virtual_address(uint64_t *pml4_raw, uint64_t vaddr) : 
-    _pml4e(NULL),
-    _pml3e(NULL),
-    _pml2e(NULL),
-    _pml1e(NULL),
-    vaddr(vaddr),
-    paddr(0),
-    pml4_raw(pml4_raw) {
-    compute_indices();
+    *level = 1;
 
-    if(!pml4_raw[pml4_idx])
-        return;
+    if(!pte_is_present(*entry))
+        return NULL;
 
-    _pml4e = new pml4e(&pml4_raw[pml4_idx]);
-    if(!_pml4e->is_present()) 
-        return;
+    return entry;
+}
 
-    pml3_raw = reinterpret_cast<uint64_t*>((pml4_raw[pml4_idx] & ~(0xfff)) + high_vma);
+// frees the tables on the walk to vaddr that no longer map anything, bottom up. the top-level entries of the upper
+// half are shared by every page map and always stay. freed tables are released by the next shootdown
+template <size_t levels>
+void page_table<levels>::prune(uint64_t vaddr) {
+    uint64_t *path[levels + 1];
+    uint64_t *table = highest_raw;
+    size_t depth = levels + 1;
 
-    if(!pml3_raw[pml3_idx])
-        return;
+    for(size_t i = levels; i > 1; i--) {
+        uint64_t *entry = &table[level_index(vaddr, i)];
 
-    _pml3e = new pml3e(&pml3_raw[pml3_idx]);
-    if(!_pml3e->is_present() || _pml3e->is_huge())
-        return;
+        if(!pte_is_present(*entry) || (i <= 3 && pte_is_huge(*entry)))
+            break;
 
-    pml2_raw = reinterpret_cast<uint64_t*>((pml3_raw[pml3_idx] & ~(0xfff)) + high_vma);
+        path[i] = entry;
+        depth = i;
+        table = pte_table(*entry);
+    }
 
-    if(!pml2_raw[pml2_idx])
-        return;
+    for(size_t i = depth; i <= levels; i++) {
+        if(i == levels && is_upper_half(vaddr))
+            break;
 
-    _pml2e = new pml2e(&pml2_raw[pml2_idx]);
-    if(!_pml2e->is_present() || _pml2e->is_huge())
-        return;
+        uint64_t *child = pte_table(*path[i]);
 
-    pml1_raw = reinterpret_cast<uint64_t*>((pml2_raw[pml2_idx] & ~(0xfff)) + high_vma);
+        for(size_t j = 0; j < table_entries; j++) {
+            if(child[j])
+                return;
+        }
 
-    if(!pml1_raw[pml1_idx])
-        return;
+        release_later(*path[i] & pte_addr_mask);
+        *path[i] = 0;
+    }
+}
 
-    _pml1e = new pml1e(&pml1_raw[pml1_idx]);
+// level of the leaves that flags describe, pte_giant only means something next to pte_ps
+static size_t leaf_level(uint64_t flags) {
+    if(!(flags & pte_ps))
+        return 1;
+
+    return (flags & pte_giant) ? 3 : 2;
 }
 
-void pml4_table::virtual_address::map(uint64_t pml4_flags, uint64_t pml3_flags, uint64_t pml2_flags, uint64_t pml1_flags, ssize_t pa) {
-    if(pml4_raw == NULL)
-        return;
+static void release_frames(uint64_t *frames, size_t cnt) {
+    for(size_t i = 0; i < cnt; i++) {
+        pmm::page *pg = pmm::phys_to_page(frames[i]);
+        if(pg)
+            pmm::page_unref(pg);
+    }
+}
 
-    if(!pml4_raw[pml4_idx]) {
-        if(!pml4_flags)
-            return;
-        pml4_raw[pml4_idx] = pmm::calloc(1) | pml4_flags;
+// replaces the huge leaf at level with a table of level - 1 leaves over the same range. with owned set the frame is
+// split in the pmm as well, or copied when another page map still shares it (stale is then the frame to unref)
+static bool split_leaf(uint64_t *entry, size_t level, bool owned, uint64_t *stale) {
+    size_t table = pmm::calloc(1);
+    if(table == -1ull)
+        return false;
+
+    uint64_t *sub = reinterpret_cast<uint64_t*>(table + high_vma);
+    uint64_t paddr = pte_base(*entry, level);
+    uint64_t flags = *entry & ~pte_huge_addr_mask;
+
+    if(level == 2) {
+        bool pat = flags & pte_huge_pat;
+
+        flags &= ~(pte_ps | pte_huge_pat);
+        if(pat)
+            flags |= pte_pat;
     }
 
-    _pml4e = new pml4e(&pml4_raw[pml4_idx]);
-    pml3_raw = reinterpret_cast<uint64_t*>((pml4_raw[pml4_idx] & ~(0xfff)) + high_vma);
-    if(!pml3_raw[pml3_idx]) {
-        if(!pml3_flags)
-            return;
+    size_t sub_length = level_length(level - 1);
+    size_t sub_cnt = sub_length / page_size;
 
-        if(pml3_flags & (1 << 7)) { // PS
-            pml3_raw[pml3_idx] = paddr | pml3_flags; 
-        } else {
-            pml3_raw[pml3_idx] = pmm::calloc(1) | pml3_flags; 
+    pmm::page *pg = owned ? pmm::phys_to_page(paddr) : NULL;
+    bool shared = pg && __atomic_load_n(&pg->refcnt, __ATOMIC_ACQUIRE) > 1;
+
+    for(size_t i = 0; i < table_entries; i++) {
+        uint64_t frame = paddr + i * sub_length;
+
+        if(shared) {
+            frame = (sub_cnt == 1) ? pmm::alloc(1) : pmm::alloc_huge(sub_cnt);
+
+            if(frame == -1ull) {
+                for(size_t j = 0; j < i; j++) {
+                    if(sub_cnt == 1) {
+                        pmm::free(pte_base(sub[j], 1), 1);
+                    } else {
+                        pmm::free_huge(pte_base(sub[j], level - 1), sub_cnt);
+                    }
+                }
+
+                pmm::free(table, 1);
+                return false;
+            }
+
+            memcpy64(reinterpret_cast<uint64_t*>(frame + high_vma), reinterpret_cast<uint64_t*>(paddr + i * sub_length + high_vma), sub_length / 8);
         }
+
+        sub[i] = frame | flags;
+
+        if(pg && sub_cnt == 1 && (flags & pte_user))
+            pmm::set_movable(frame, &sub[i]);
     }
 
-    _pml3e = new pml3e(&pml3_raw[pml3_idx]);
-    if(_pml3e->is_huge()) {
-        page_length = 0x40000000;
-        if(pa != -1)
-            _pml3e->set_pa(pa);
-        return;
+    if(pg && !shared)
+        pmm::split_huge(paddr, sub_cnt * table_entries, sub_cnt);
+
+    *stale = shared ? paddr : -1;
+    *entry = table | pte_present | pte_rw | (flags & pte_user);
+
+    return true;
+}
+
+// splits the huge leaves covering vaddr above level, so the direct map's 1GiB leaves can take smaller mappings
+// with their own caching. lock must be held
+template <size_t levels>
+bool page_table<levels>::split_to(uint64_t vaddr, size_t level) {
+    for(;;) {
+        size_t found;
+        uint64_t *entry = lookup(vaddr, &found);
+
+        if(entry == NULL || found <= level)
+            return true;
+
+        uint64_t stale;
+        if(!split_leaf(entry, found, false, &stale))
+            return false;
+
+        invalidate(vaddr & ~(level_length(found) - 1), level_length(found));
     }
+}
 
-    pml2_raw = reinterpret_cast<uint64_t*>((pml3_raw[pml3_idx] & ~(0xfff)) + high_vma);
+template <size_t levels>
+ssize_t page_table<levels>::map_range(uint64_t vaddr, size_t cnt, size_t flags, ssize_t pa) {
+    size_t level = (flags & pte_ps) ? 2 : 1;
+    uint64_t table_flags = pte_present | pte_rw | (flags & pte_user);
+    uint64_t pa_flags = pte_pa(pa, level);
 
-    if(!pml2_raw[pml2_idx]) {
-        if(!pml2_flags)
-            return;
+    spin_lock_ack(&lock);
 
-        if(pml2_flags & (1 << 7)) { // PS
-            pml2_raw[pml2_idx] = paddr | pml2_flags; 
-        } else {
-            pml2_raw[pml2_idx] = pmm::calloc(1) | pml2_flags; 
+    while(cnt) {
+        size_t batch = table_entries - level_index(vaddr, level);
+        if(batch > cnt)
+            batch = cnt;
+
+        uint64_t *entry = walk(vaddr, level, table_flags);
+
+        // the walk also stops at a huge leaf that already maps the whole batch
+        size_t found;
+        if(entry == NULL && lookup(vaddr, &found) == NULL) {
+            spin_release(&lock);
+            return -1;
         }
-    }
 
-    _pml2e = new pml2e(&pml2_raw[pml2_idx]);
-    if(_pml2e->is_huge()) {
-        page_length = 0x200000;
-        if(pa != -1)
-            _pml2e->set_pa(pa);
-        return;
-    }
+        for(size_t i = 0; entry && i < batch; i++) {
+            if(pte_is_mapped(entry[i]))
+                continue;
 
-    pml1_raw = reinterpret_cast<uint64_t*>((pml2_raw[pml2_idx] & ~(0xfff)) + high_vma);
+            // a user huge leaf only comes from the fault path, which holds locks with interrupts off and falls back to
+            // 4KiB frames, so it never compacts and leaves that to the collapse thread
+            size_t paddr;
+            if(flags & pte_user) {
+                paddr = (level == 2) ? pmm::calloc_huge_nowait(pmm::huge_page_cnt) : pmm::calloc(1);
+            } else {
+                paddr = (level == 2) ? pmm::alloc_huge(pmm::huge_page_cnt) : pmm::alloc(1);
+            }
 
-    if(!pml1_raw[pml1_idx]) {
-        if(!pml1_flags)
-            return;
+            if(paddr == -1ull) {
+                spin_release(&lock);
+                return -1;
+            }
+
+            entry[i] = paddr | flags | pa_flags;
+
+            if(level == 1 && (flags & pte_user))
+                pmm::set_movable(paddr, &entry[i]);
+        }
 
-        pml1_raw[pml1_idx] = paddr | pml1_flags;
+        vaddr += batch * level_length(level);
+        cnt -= batch;
     }
 
-    _pml1e = new pml1e(&pml1_raw[pml1_idx]);
-    page_length = 0x1000;
+    spin_release(&lock);
 
-    if(pa != -1)
-        _pml1e->set_pa(pa);
+    return 0;
 }
 
-uint64_t pml4_table::virtual_address::unmap() {
-    if(_pml3e->is_huge()) {
-        uint64_t paddr = _pml3e->get_base();
-        _pml3e->set_present(0);
-        return paddr;
-    }
+template <size_t levels>
+void page_table<levels>::map_range_raw(uint64_t vaddr, uint64_t paddr, size_t cnt, uint64_t flags1, uint64_t flags0, ssize_t pa) {
+    size_t level = leaf_level(flags0);
+    flags0 &= ~pte_giant;
+    uint64_t pa_flags = pte_pa(pa, level);
+
+    spin_lock_ack(&lock);
+
+    while(cnt) {
+        size_t batch = table_entries - level_index(vaddr, level);
+        if(batch > cnt)
+            batch = cnt;
+
+        uint64_t *entry = split_to(vaddr, level) ? walk(vaddr, level, flags1) : NULL;
+        if(entry == NULL)
+            print("VMM: unable to map {x}\n", vaddr);
+
+        for(size_t i = 0; entry && i < batch; i++) {
+            if(pte_is_present(entry[i])) {
+                entry[i] = pte_set_pa(entry[i], pa, level);
+                invalidate(vaddr + i * level_length(level), level_length(level));
+            } else {
+                entry[i] = (paddr + i * level_length(level)) | flags0 | pa_flags;
+            }
+        }
 
-    if(_pml2e->is_huge()) {
-        uint64_t paddr = _pml2e->get_base();
-        _pml2e->set_present(0);
-        return paddr;
+        vaddr += batch * level_length(level);
+        paddr += batch * level_length(level);
+        cnt -= batch;
     }
 
-    uint64_t paddr = _pml1e->get_base();
-    _pml1e->set_present(0);
-    return paddr;
+    spin_release(&lock);
+
+    shootdown();
 }
 
-void pml5_table::virtual_address::map(uint64_t pml5_flags, uint64_t pml4_flags, uint64_t pml3_flags, uint64_t pml2_flags, uint64_t pml1_flags, ssize_t pa) {
-    if(pml5_raw == NULL)
-        return;
+// cnt is in 4KiB pages, holes are skipped and huge pages only partially covered by the range are split first.
+// nothing is flushed here: tables left empty, and with release set the frames, go to the next shootdown(), which
+// the caller runs once it has dropped vma_lock
+template <size_t levels>
+void page_table<levels>::unmap_range(uint64_t vaddr, size_t cnt, bool release) {
+    vaddr &= ~(page_size - 1);
+    uint64_t end = vaddr + cnt * page_size;
 
-    if(!pml5_raw[pml5_idx]) {
-        if(!pml5_flags)
-            return;
-        pml5_raw[pml5_idx] = pmm::calloc(1) | pml5_flags;
-    }
+    spin_lock_ack(&lock);
 
-    _pml5e = new pml5e(&pml5_raw[pml5_idx]);
-    pml4_raw = reinterpret_cast<uint64_t*>((pml5_raw[pml5_idx] & ~(0xfff)) + high_vma);
+    while(vaddr < end) {
+        uint64_t *entry = walk(vaddr, 1, 0);
 
-    if(!pml4_raw[pml4_idx]) {
-        if(!pml4_flags)
-            return;
-        pml4_raw[pml4_idx] = pmm::calloc(1) | pml4_flags;
-    }
+        if(entry) {
+            size_t batch = table_entries - level_index(vaddr, 1);
+            if(batch > (end - vaddr) / page_size)
+                batch = (end - vaddr) / page_size;
 
-    _pml4e = new pml4e(&pml4_raw[pml3_idx]);
-    pml3_raw = reinterpret_cast<uint64_t*>((pml4_raw[pml4_idx] &  ~(0xfff)) + vmm::high_vma);
+            for(size_t i = 0; i < batch; i++) {
+                if(!pte_is_mapped(entry[i]))
+                    continue;
 
-    if(!pml3_raw[pml3_idx]) {
-        if(!pml3_flags)
-            return;
+                if(release)
+                    release_later(pte_base(entry[i], 1));
 
-        if(pml3_flags & (1 << 7)) { // PS
-            pml3_raw[pml3_idx] = paddr | pml3_flags;
-        } else {
-            pml3_raw[pml3_idx] = pmm::calloc(1) + pml3_flags;
+                entry[i] = 0;
+                invalidate(vaddr + i * page_size, page_size);
+            }
+
+            prune(vaddr);
+
+            vaddr += batch * page_size;
+            continue;
         }
-    } 
 
-    _pml3e = new pml3e(&pml3_raw[pml3_idx]);
-    if(_pml3e->is_huge()) {
-        page_length = 0x40000000;
-        if(pa != -1)
-            _pml3e->set_pa(pa);
-        return;
-    }
-    
-    pml2_raw = reinterpret_cast<uint64_t*>((pml3_raw[pml3_idx] & ~(0xfff)) + high_vma);
+        size_t level;
+        entry = lookup(vaddr, &level);
 
-    if(!pml2_raw[pml2_idx]) {
-        if(!pml2_flags)
-            return;
+        uint64_t length = level_length(level);
+        uint64_t next = (vaddr & ~(length - 1)) + length;
 
-        if(pml2_flags & (1 << 7)) { // PS
-            pml2_raw[pml2_idx] = paddr | pml2_flags; 
-        } else {
-            pml2_raw[pml2_idx] = pmm::calloc(1) | pml2_flags; 
+        if(entry && ((vaddr & (length - 1)) || next > end)) {
+            uint64_t stale;
+
+            if(split_leaf(entry, level, release, &stale)) {
+                invalidate(vaddr & ~(length - 1), length);
+
+                if(stale != -1ull)
+                    release_later(stale);
+
+                continue;
+            }
+        } else if(entry) {
+            if(release)
+                release_later(pte_base(*entry, level));
+
+            *entry = 0;
+            invalidate(vaddr, length);
+
+            prune(vaddr);
         }
+
+        vaddr = next;
     }
 
-    _pml2e = new pml2e(&pml2_raw[pml2_idx]);
-    
-    if(_pml2e->is_huge()) {
-        page_length = 0x200000;
-        if(pa != -1)
-            _pml2e->set_pa(pa);
-        return;
+    spin_release(&lock);
+}
+
+template <size_t levels>
+void page_table<levels>::map_page(uint64_t vaddr, uint64_t flags, ssize_t pa) {
+    size_t level = (flags & pte_ps) ? 2 : 1;
+
+    spin_lock_ack(&lock);
+
+    uint64_t *entry = walk(vaddr, level, pte_present | pte_rw | (flags & pte_user));
+
+    if(entry && pte_is_present(*entry)) {
+        *entry = pte_set_pa(*entry, pa, level);
+        invalidate(vaddr, level_length(level));
+    } else if(entry) {
+        size_t paddr = (level == 2) ? pmm::calloc_huge(pmm::huge_page_cnt) : pmm::calloc(1);
+        if(paddr != -1ull)
+            *entry = paddr | flags | pte_pa(pa, level);
     }
 
-    pml1_raw = reinterpret_cast<uint64_t*>((pml2_raw[pml2_idx] & ~(0xfff)) + high_vma);
+    spin_release(&lock);
 
-    if(!pml1_raw[pml1_idx]) {
-        if(!pml1_flags)
-            return;
+    shootdown();
+}
+
+template <size_t levels>
+void page_table<levels>::map_page_raw(uint64_t vaddr, uint64_t paddr, uint64_t flags1, uint64_t flags0, ssize_t pa) {
+    size_t level = leaf_level(flags0);
+    flags0 &= ~pte_giant;
+
+    spin_lock_ack(&lock);
 
-        pml1_raw[pml1_idx] = paddr | pml1_flags;
+    uint64_t *entry = split_to(vaddr, level) ? walk(vaddr, level, flags1) : NULL;
+    if(entry == NULL)
+        print("VMM: unable to map {x}\n", vaddr);
+
+    if(entry && pte_is_present(*entry)) {
+        *entry = pte_set_pa(*entry, pa, level);
+        invalidate(vaddr, level_length(level));
+    } else if(entry) {
+        *entry = paddr | flags0 | pte_pa(pa, level);
     }
 
-    _pml1e = new pml1e(&pml1_raw[pml1_idx]);
+    spin_release(&lock);
 
-    page_length = 0x1000;
-    if(pa != -1)
-        _pml1e->set_pa(pa);
+    shootdown();
 }
 
-uint64_t pml5_table::virtual_address::unmap() {
-    if(_pml3e->is_huge()) {
-        uint64_t paddr = _pml3e->get_base();
-        _pml3e->set_present(0);
-        return paddr;
+// maps the 4KiB frame paddr at vaddr, returns 1 when something is mapped there already and -1 when a table could not
+// be allocated. the caller keeps its reference unless 0 is returned
+template <size_t levels>
+ssize_t page_table<levels>::map_frame(uint64_t vaddr, uint64_t paddr, uint64_t flags) {
+    spin_lock_ack(&lock);
+
+    uint64_t *entry = walk(vaddr, 1, pte_present | pte_rw | (flags & pte_user));
+
+    if(entry == NULL) {
+        size_t level;
+        ssize_t ret = lookup(vaddr, &level) ? 1 : -1;
+        spin_release(&lock);
+        return ret;
     }
 
-    if(_pml2e->is_huge()) {
-        uint64_t paddr = _pml2e->get_base();
-        _pml2e->set_present(0);
-        return paddr;
+    if(pte_is_mapped(*entry)) {
+        spin_release(&lock);
+        return 1;
     }
 
-    uint64_t paddr = _pml1e->get_base();
-    _pml1e->set_present(0);
-    return paddr;
+    *entry = paddr | flags;
+
+    spin_release(&lock);
+
+    return 0;
 }
 
-void pml4_table::map_range(uint64_t vaddr, size_t cnt, size_t flags, ssize_t pa) {
-    spin_lock(&lock);
+template <size_t levels>
+uint64_t page_table<levels>::unmap_page(uint64_t vaddr) {
+    spin_lock_ack(&lock);
 
-    if(flags & (1 << 7)) {
-        for(size_t i = 0; i < cnt; i++) {
-            virtual_address new_addr(highest_raw, vaddr, pmm::alloc(1));
-            new_addr.map(0x3, 0x3, flags, 0, pa);
-            vaddr += 0x200000;
-        }
-    } else {
-        for(size_t i = 0; i < cnt; i++) {
-            virtual_address new_addr(highest_raw, vaddr, pmm::alloc(1));
-            new_addr.map(0x3, 0x3, 0x3, flags, pa);
-            vaddr += 0x1000;
-        }
+    size_t level;
+    uint64_t *entry = lookup(vaddr, &level);
+
+    if(entry == NULL) {
+        spin_release(&lock);
+        return -1;
     }
 
+    uint64_t paddr = pte_base(*entry, level);
+    *entry = 0;
+
+    invalidate(vaddr & ~(level_length(level) - 1), level_length(level));
+
     spin_release(&lock);
-}
 
-void pml4_table::unmap_range(uint64_t vaddr, size_t cnt) {
-    spin_lock(&lock);
+    return paddr;
+}
 
-    for(size_t i = 0; i < cnt; i++) {
-        virtual_address addr(highest_raw, vaddr);
-        if(!addr.page_length) {
-            spin_release(&lock);
+// a frame that finds no room in the chain and no frame to grow it is leaked rather than freed too early
+void pmlx_table::release_later(uint64_t paddr) {
+    if(stale == NULL || stale_cnt == table_entries) {
+        size_t frame = pmm::alloc(1);
+        if(frame == -1ull)
             return;
-        }
-        addr.unmap();
-        vaddr += addr.page_length;
+
+        uint64_t *chunk = reinterpret_cast<uint64_t*>(frame + high_vma);
+        chunk[0] = reinterpret_cast<uint64_t>(stale);
+
+        stale = chunk;
+        stale_cnt = 1;
     }
+
+    stale[stale_cnt++] = paddr;
+}
+
+void pmlx_table::shootdown() {
+    spin_lock_ack(&lock);
+
+    uint64_t start = tlb_start;
+    uint64_t end = tlb_end;
+    uint64_t *frames = stale;
+    size_t cnt = stale_cnt;
+
+    tlb_start = -1;
+    tlb_end = 0;
+    stale = NULL;
+    stale_cnt = 0;
+
     spin_release(&lock);
+
+    if(start < end)
+        tlb_shootdown(this, start, end);
+
+    while(frames) {
+        uint64_t *prev = reinterpret_cast<uint64_t*>(frames[0]);
+
+        release_frames(&frames[1], cnt - 1);
+        pmm::free(reinterpret_cast<uint64_t>(frames) - high_vma, 1);
+
+        frames = prev;
+        cnt = table_entries;
+    }
 }
 
-void pml5_table::map_range(uint64_t vaddr, size_t cnt, size_t flags, ssize_t pa) {
-    spin_lock(&lock);
+static pcid_slot pcid_slots[numa::max_cpus][pcid_cnt];
+static size_t pcid_next[numa::max_cpus];
+
+// pcid 0 is left to the boot path and to cpus that are not online yet, slots 1..pcid_cnt-1 are handed out per cpu
+void pmlx_table::init() {
+    uint64_t cr3 = reinterpret_cast<uint64_t>(highest_raw) - high_vma;
+
+    if(!pcid_enabled || !smp::percpu_online) {
+        asm volatile ("mov %0, %%cr3" :: "r"(cr3) : "memory");
+        return;
+    }
+
+    size_t rflags = irq_save();
+
+    size_t index = smp::core_local().index;
+    pcid_slot *slots = pcid_slots[index];
 
-    size_t extra = 0;
-    if(flags & (1 << 2))
-        extra = (1 << 2);
+    // the caller has just stored this table as the cpu's page_map. a shootdown bumps tlb_gen before it reads page_map,
+    // so without the fence the store could still be in the store buffer when the old generation is read here and
+    // neither side would flush
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
 
-    if(flags & (1 << 7)) {
-        for(size_t i = 0; i < cnt; i++) {
-            virtual_address new_addr(highest_raw, vaddr, pmm::alloc(1));
-            new_addr.map(0x3 | extra, 0x3 | extra, 0x3 | extra, flags, 0, pa);
-            vaddr += 0x200000;
+    uint64_t gen = __atomic_load_n(&tlb_gen, __ATOMIC_SEQ_CST);
+
+    size_t pcid = 0;
+    for(size_t i = 1; i < pcid_cnt; i++) {
+        if(slots[i].ctx_id == ctx_id) {
+            pcid = i;
+            break;
         }
+    }
+
+    if(pcid && slots[pcid].tlb_gen == gen) {
+        cr3 |= pcid | cr3_no_flush;
     } else {
-        for(size_t i = 0; i < cnt; i++) {
-            virtual_address new_addr(highest_raw, vaddr, pmm::alloc(1));
-            new_addr.map(0x3 | extra, 0x3 | extra, 0x3 | extra, 0x3 | extra, flags, pa);
-            vaddr += 0x1000;
+        if(pcid == 0) {
+            pcid = pcid_next[index] + 1;
+            pcid_next[index] = (pcid_next[index] + 1) % (pcid_cnt - 1);
         }
+
+        slots[pcid] = { ctx_id, gen };
+        cr3 |= pcid;
     }
 
-    spin_release(&lock);
+    asm volatile ("mov %0, %%cr3" :: "r"(cr3) : "memory");
+
+    irq_restore(rflags);
 }
 
-void pml5_table::unmap_range(uint64_t vaddr, size_t cnt) {
-    spin_lock(&lock);
+static size_t shootdown_lock = 0;
+static uint64_t shootdown_start;
+static uint64_t shootdown_end;
+static pmlx_table *shootdown_map;
+static uint64_t shootdown_gen;
+static size_t shootdown_pending = 0;
+static bool shootdown_target[numa::max_cpus];
+
+void tlb_invalidate(uint64_t start, uint64_t end) {
+    if(end - start > invlpg_max * page_size) {
+        if(is_upper_half(end - 1)) {
+            if(invpcid_enabled) {
+                invpcid(invpcid_all_global, 0, 0);
+            } else {
+                tlb_flush_global();
+            }
+        } else {
+            if(invpcid_enabled) {
+                invpcid(invpcid_context, get_pml4() & 0xfff, 0);
+            } else {
+                tlb_flush();
+            }
+        }
+        return;
+    }
 
-    for(size_t i = 0; i < cnt; i++) {
-        virtual_address addr(highest_raw, vaddr);
-        if(!addr.page_length) {
-            spin_release(&lock);
+    // invlpg only reaches the current pcid and global entries, a kernel mapping without the global bit can be cached
+    // under every pcid this cpu has handed out
+    if(pcid_enabled && is_upper_half(end - 1)) {
+        if(!invpcid_enabled) {
+            tlb_flush_global();
             return;
         }
-        addr.unmap();
-        vaddr += addr.page_length;
+
+        for(uint64_t vaddr = start & ~(page_size - 1); vaddr < end; vaddr += page_size) {
+            invlpg(vaddr);
+
+            for(size_t pcid = 0; pcid < pcid_cnt; pcid++)
+                invpcid(invpcid_address, pcid, vaddr);
+        }
+
+        return;
     }
 
-    spin_release(&lock);
+    for(uint64_t vaddr = start & ~(page_size - 1); vaddr < end; vaddr += page_size)
+        invlpg(vaddr);
 }
 
-void pml4_table::map_page(uint64_t vaddr, uint64_t flags, ssize_t pa) {
-    spin_lock(&lock);
+// the range of generation gen of page_map was flushed from the pcid this cpu runs it under. the slot only moves up to
+// gen when every older generation was flushed as well, out of order flushes leave it to the next switch to flush
+static void pcid_flushed(pmlx_table *page_map, uint64_t gen) {
+    if(!pcid_enabled)
+        return;
 
-    if(flags & (1 << 7)) {
-        virtual_address addr(highest_raw, vaddr, pmm::calloc(0x200));
-        addr.map(0x3, 0x3, flags, 0, pa);
-    } else {
-        virtual_address addr(highest_raw, vaddr, pmm::calloc(1));
-        addr.map(0x3, 0x3, 0x3, flags, pa);
+    pcid_slot *slots = pcid_slots[smp::core_local().index];
+
+    for(size_t i = 1; i < pcid_cnt; i++) {
+        if(slots[i].ctx_id == page_map->ctx_id) {
+            if(slots[i].tlb_gen + 1 == gen)
+                slots[i].tlb_gen = gen;
+            return;
+        }
     }
+}
 
-    spin_release(&lock);
+// answers a pending shootdown aimed at this cpu, for code spinning with interrupts off
+void tlb_shootdown_ack() {
+    if(!smp::percpu_online)
+        return;
 
-    tlb_flush();
-}
+    size_t index = smp::core_local().index;
 
-void pml4_table::map_page_raw(uint64_t vaddr, uint64_t paddr, uint64_t flags1, uint64_t flags0, ssize_t pa) {
-    spin_lock(&lock);
+    if(!__atomic_exchange_n(&shootdown_target[index], false, __ATOMIC_ACQ_REL))
+        return;
 
-    if(flags0 & (1 << 7)) {
-        virtual_address addr(highest_raw, vaddr, paddr);
-        addr.map(flags1, flags1, flags0, 0, pa);
-    } else {
-        virtual_address addr(highest_raw, vaddr, paddr);
-        addr.map(flags1, flags1, flags1, flags0, pa);
-    }
+    tlb_invalidate(shootdown_start, shootdown_end);
 
-    spin_release(&lock);
+    if(shootdown_map && smp::core_local().page_map == shootdown_map)
+        pcid_flushed(shootdown_map, shootdown_gen);
 
-    tlb_flush();
+    __atomic_sub_fetch(&shootdown_pending, 1, __ATOMIC_RELEASE);
 }
 
-void pml4_table::unmap_page(uint64_t vaddr) {
-    spin_lock(&lock);
+void tlb_shootdown_handler(regs *regs_cur) {
+    if(regs_cur->cs & 0x3)
+        swapgs();
 
-    virtual_address addr(highest_raw, vaddr);
+    tlb_shootdown_ack();
 
-    if(!addr.page_length) {
-        spin_release(&lock);
+    if(regs_cur->cs & 0x3)
+        swapgs();
+}
+
+// kernel addresses are shared by every page map so they go to every online cpu,
+// user addresses only to the cpus currently running page_map (NULL for all of them)
+void tlb_shootdown(pmlx_table *page_map, uint64_t start, uint64_t end) {
+    if(!smp::percpu_online) {
+        tlb_invalidate(start, end);
         return;
     }
 
-    addr.unmap();
+    size_t rflags = irq_save();
 
-    spin_release(&lock);
-}
+    smp::cpu &local = smp::core_local();
+    bool all = page_map == NULL || is_upper_half(end - 1);
+    uint64_t gen = 0;
 
-void pml5_table::map_page(uint64_t vaddr, uint64_t flags, ssize_t pa) {
-    spin_lock(&lock);
+    if(!all)
+        gen = __atomic_add_fetch(&page_map->tlb_gen, 1, __ATOMIC_SEQ_CST);
 
-    if(flags & (1 << 7)) {
-        virtual_address addr(highest_raw, vaddr, pmm::calloc(0x200));
-        addr.map(0x3, 0x3, 0x3, flags, 0, pa);
-    } else {
-        virtual_address addr(highest_raw, vaddr, pmm::calloc(1));
-        addr.map(0x3, 0x3, 0x3, 0x3, flags, pa);
-    }
+    if(all || local.page_map == page_map)
+        tlb_invalidate(start, end);
 
-    spin_release(&lock);
+    if(!all && local.page_map == page_map)
+        pcid_flushed(page_map, gen);
 
-    tlb_flush();
-}
+    auto is_target = [&](smp::cpu &cpu) {
+        return cpu.index != local.index && cpu.online && (all || __atomic_load_n(&cpu.page_map, __ATOMIC_SEQ_CST) == page_map);
+    };
+
+    size_t cnt = 0;
+    for(size_t i = 0; i < smp::cpus.size(); i++) {
+        if(is_target(smp::cpus[i]))
+            cnt++;
+    }
 
-void pml5_table::map_page_raw(uint64_t vaddr, uint64_t paddr, uint64_t flags1, uint64_t flags0, ssize_t pa) {
-    spin_lock(&lock);
+    if(cnt == 0) {
+        irq_restore(rflags);
+        return;
+    }
 
-    if(flags0 & (1 << 7)) {
-        virtual_address addr(highest_raw, vaddr, paddr);
-        addr.map(flags1, flags1, flags1, flags0, 0, pa);
-    } else {
-        virtual_address addr(highest_raw, vaddr, paddr);
-        addr.map(flags1, flags1, flags1, flags1, flags0, pa);
+    while(!spin_trylock(&shootdown_lock)) {
+        tlb_shootdown_ack();
+        asm ("pause");
     }
 
-    spin_release(&lock);
+    shootdown_start = start;
+    shootdown_end = end;
+    shootdown_map = all ? NULL : page_map;
+    shootdown_gen = gen;
 
-    tlb_flush();
-}
+    bool targets[numa::max_cpus];
 
-void pml5_table::unmap_page(uint64_t vaddr) {
-    spin_lock(&lock);
+    cnt = 0;
+    for(size_t i = 0; i < smp::cpus.size(); i++) {
+        targets[i] = is_target(smp::cpus[i]);
+        if(targets[i])
+            cnt++;
+    }
 
-    virtual_address addr(highest_raw, vaddr);
+    __atomic_store_n(&shootdown_pending, cnt, __ATOMIC_RELEASE);
 
-    if(!addr.page_length) {
-        spin_release(&lock);
-        return;
+    for(size_t i = 0; i < smp::cpus.size(); i++) {
+        if(!targets[i])
+            continue;
+
+        __atomic_store_n(&shootdown_target[i], true, __ATOMIC_RELEASE);
+        apic::lapic->send_ipi(smp::cpus[i].apic_id, tlb_shootdown_vector);
     }
 
-    addr.unmap();
+    while(__atomic_load_n(&shootdown_pending, __ATOMIC_ACQUIRE))
+        asm ("pause");
 
-    spin_release(&lock);
+    spin_release(&shootdown_lock);
+
+    irq_restore(rflags);
 }
 
 ssize_t set_pat() {
@@ -496,9 +743,14 @@ ssize_t set_pat() {
     return 0;
 }
 
-pmlx_table *pml4_table::create_generic() {
-    pmlx_table *table = new pml4_table;
-    table->highest_raw = reinterpret_cast<uint64_t*>(pmm::calloc(1) + high_vma);
+template <size_t levels>
+pmlx_table *page_table<levels>::create_generic() {
+    size_t root = pmm::calloc(1);
+    if(root == -1ull)
+        return NULL;
+
+    pmlx_table *table = new page_table<levels>;
+    table->highest_raw = reinterpret_cast<uint64_t*>(root + high_vma);
 
     table->highest_raw[256] = kernel_mapping->highest_raw[256];
     table->highest_raw[511] = kernel_mapping->highest_raw[511];
@@ -506,14 +758,393 @@ pmlx_table *pml4_table::create_generic() {
     return table;
 }
 
-pmlx_table *pml5_table::create_generic() {
-    pmlx_table *table = new pml5_table;
-    table->highest_raw = reinterpret_cast<uint64_t*>(pmm::calloc(1) + high_vma);
+static bool pte_is_leaf(uint64_t entry, size_t level) {
+    return level == 1 || (level <= 3 && pte_is_huge(entry));
+}
 
-    table->highest_raw[256] = kernel_mapping->highest_raw[256];
-    table->highest_raw[511] = kernel_mapping->highest_raw[511];
+// shares a user leaf with a forked child, writable leaves become read-only copy-on-write in both maps unless they are shared.
+// 4KiB leaves stop being movable first, one the pmm already froze is put back since its migration now gives up
+static uint64_t fork_leaf(uint64_t &entry, size_t level) {
+    uint64_t cur = __atomic_load_n(&entry, __ATOMIC_ACQUIRE), next;
 
-    return table;
+    // a migration that finished before the frame was pinned moved the leaf, the copy is pinned on the next pass
+    do {
+        if(level == 1)
+            pmm::clear_movable(pte_base(cur, level));
+
+        next = cur;
+        if(next & pte_migrating)
+            next = (next & ~pte_migrating) | pte_present;
+        if((next & pte_rw) && !(next & pte_shared))
+            next = (next & ~pte_rw) | pte_cow;
+    } while(!__atomic_compare_exchange_n(&entry, &cur, next, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    pmm::page *pg = pmm::phys_to_page(pte_base(next, level));
+    if(pg)
+        pmm::page_ref(pg);
+
+    return next;
+}
+
+// copies the tables under entry into dest without touching a leaf, so running out of frames leaves the parent
+// as it was. the tables allocated before the failure stay linked for destroy() to release
+static bool fork_tables(uint64_t entry, uint64_t &dest, size_t level) {
+    size_t table = pmm::calloc(1);
+    if(table == -1ull)
+        return false;
+
+    dest = table | (entry & ~pte_addr_mask);
+
+    uint64_t *src = pte_table(entry);
+    uint64_t *dest_table = pte_table(dest);
+
+    for(size_t i = 0; i < table_entries; i++) {
+        if(pte_is_mapped(src[i]) && !pte_is_leaf(src[i], level - 1) && !fork_tables(src[i], dest_table[i], level - 1))
+            return false;
+    }
+
+    return true;
+}
+
+static void fork_leaves(uint64_t *src, uint64_t *dest, size_t level) {
+    for(size_t i = 0; i < table_entries; i++) {
+        if(!pte_is_mapped(src[i]))
+            continue;
+
+        if(pte_is_leaf(src[i], level))
+            dest[i] = fork_leaf(src[i], level);
+        else
+            fork_leaves(pte_table(src[i]), pte_table(dest[i]), level - 1);
+    }
+}
+
+// the parent's writable leaves turn copy-on-write, the caller shoots down once it has dropped vma_lock. every table
+// is allocated before the first leaf is shared, so a failed fork has no copy-on-write or page refs to undo
+template <size_t levels>
+pmlx_table *page_table<levels>::fork() {
+    pmlx_table *child = create_generic();
+    if(child == NULL)
+        return NULL;
+
+    spin_lock_ack(&lock);
+
+    for(size_t i = 0; i < table_entries / 2; i++) {
+        if(pte_is_present(highest_raw[i]) && !fork_tables(highest_raw[i], child->highest_raw[i], levels)) {
+            spin_release(&lock);
+            child->destroy();
+            return NULL;
+        }
+    }
+
+    for(size_t i = 0; i < table_entries / 2; i++) {
+        if(pte_is_present(highest_raw[i]))
+            fork_leaves(pte_table(highest_raw[i]), pte_table(child->highest_raw[i]), levels - 1);
+    }
+
+    invalidate(0, user_end());
+
+    spin_release(&lock);
+
+    return child;
+}
+
+// the old frame is dropped and the tlb flushed by the caller's shootdown()
+template <size_t levels>
+ssize_t page_table<levels>::break_cow(uint64_t vaddr) {
+    spin_lock_ack(&lock);
+
+    size_t level;
+    uint64_t *entry = lookup(vaddr, &level);
+
+    // another cpu broke it first and this one faulted on its stale entry
+    if(entry && pte_is_present(*entry) && (*entry & pte_rw)) {
+        spin_release(&lock);
+        return 0;
+    }
+
+    if(entry == NULL || !(*entry & pte_cow)) {
+        spin_release(&lock);
+        return -1;
+    }
+
+    uint64_t length = level_length(level);
+    uint64_t paddr = pte_base(*entry, level);
+    uint64_t mask = level == 1 ? pte_addr_mask : pte_huge_addr_mask;
+
+    pmm::page *pg = pmm::phys_to_page(paddr);
+
+    if(pg && __atomic_load_n(&pg->refcnt, __ATOMIC_ACQUIRE) == 1) {
+        *entry = (*entry & ~pte_cow) | pte_rw;
+    } else {
+        size_t copy = (level == 1) ? pmm::alloc(1) : pmm::alloc_huge(length / page_size);
+        if(copy == -1ull) {
+            spin_release(&lock);
+            return -1;
+        }
+
+        memcpy64(reinterpret_cast<uint64_t*>(copy + high_vma), reinterpret_cast<uint64_t*>(paddr + high_vma), length / 8);
+
+        *entry = (*entry & ~(pte_cow | mask)) | copy | pte_rw;
+
+        if(level == 1 && (*entry & pte_user))
+            pmm::set_movable(copy, entry);
+
+        release_later(paddr);
+    }
+
+    invalidate(vaddr & ~(length - 1), length);
+
+    spin_release(&lock);
+
+    return 0;
+}
+
+// a 2MiB table can be folded into a huge page when every leaf is a writable, privately owned user page with the same flags
+static bool collapsible(uint64_t *pmd) {
+    if(pmd == NULL || !pte_is_present(*pmd) || pte_is_huge(*pmd))
+        return false;
+
+    uint64_t *table = pte_table(*pmd);
+    uint64_t mask = ~(pte_addr_mask | pte_accessed | pte_dirty);
+    uint64_t flags = table[0] & mask;
+
+    if((flags & (pte_present | pte_rw | pte_user)) != (pte_present | pte_rw | pte_user) || (flags & pte_cow))
+        return false;
+
+    for(size_t i = 0; i < table_entries; i++) {
+        if((table[i] & mask) != flags)
+            return false;
+
+        pmm::page *pg = pmm::phys_to_page(pte_base(table[i], 1));
+        if(pg == NULL || __atomic_load_n(&pg->refcnt, __ATOMIC_ACQUIRE) != 1)
+            return false;
+    }
+
+    return true;
+}
+
+// puts back the leaves of table that are still frozen
+static void thaw_leaves(uint64_t *leaves, size_t cnt) {
+    for(size_t i = 0; i < cnt; i++) {
+        uint64_t entry = __atomic_load_n(&leaves[i], __ATOMIC_ACQUIRE);
+
+        if(entry & pte_migrating)
+            __atomic_compare_exchange_n(&leaves[i], &entry, (entry & ~pte_migrating) | pte_present, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    }
+}
+
+// copies the 4KiB leaves under the 2MiB range holding vaddr into one huge page. the leaves are frozen the way the pmm
+// freezes a frame it migrates, so faults on the range retry while they are copied and a munmap, fork or migration that
+// touches one of them makes the collapse give up. no lock is held across a shootdown, and none needs vma_lock
+template <size_t levels>
+ssize_t page_table<levels>::collapse(uint64_t vaddr) {
+    vaddr &= ~(level_length(2) - 1);
+
+    spin_lock_ack(&lock);
+    bool ok = highest_raw != NULL && collapsible(walk(vaddr, 2, 0));
+    spin_release(&lock);
+
+    if(!ok)
+        return -1;
+
+    size_t huge = pmm::alloc_huge(pmm::huge_page_cnt);
+    if(huge == -1ull)
+        return -1;
+
+    spin_lock_ack(&lock);
+
+    uint64_t *pmd = highest_raw ? walk(vaddr, 2, 0) : NULL;
+    if(!collapsible(pmd)) {
+        spin_release(&lock);
+        pmm::free_huge(huge, pmm::huge_page_cnt);
+        return -1;
+    }
+
+    uint64_t *leaves = pte_table(*pmd);
+    uint64_t table = *pmd & pte_addr_mask;
+
+    uint64_t flags = leaves[0] & ~(pte_addr_mask | pte_accessed | pte_dirty | pte_pat);
+    if(leaves[0] & pte_pat)
+        flags |= pte_huge_pat;
+
+    size_t frozen = 0;
+
+    for(; frozen < table_entries; frozen++) {
+        uint64_t entry = leaves[frozen];
+
+        if(!pte_is_present(entry) || !__atomic_compare_exchange_n(&leaves[frozen], &entry, (entry & ~pte_present) | pte_migrating, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if(frozen < table_entries) {
+        thaw_leaves(leaves, frozen);
+        spin_release(&lock);
+        pmm::free_huge(huge, pmm::huge_page_cnt);
+        return -1;
+    }
+
+    // the table stays readable even if a munmap prunes it meanwhile
+    pmm::page_ref(pmm::phys_to_page(table));
+
+    invalidate(vaddr, level_length(2));
+
+    spin_release(&lock);
+
+    shootdown();
+
+    for(size_t i = 0; i < table_entries; i++) {
+        uint64_t entry = __atomic_load_n(&leaves[i], __ATOMIC_ACQUIRE);
+
+        if(entry & pte_migrating)
+            memcpy64(reinterpret_cast<uint64_t*>(huge + i * page_size + high_vma), reinterpret_cast<uint64_t*>(pte_base(entry, 1) + high_vma), page_size / 8);
+    }
+
+    spin_lock_ack(&lock);
+
+    bool intact = highest_raw != NULL && walk(vaddr, 2, 0) == pmd && (*pmd & pte_addr_mask) == table && pte_is_present(*pmd);
+
+    // claimed leaves drop pte_migrating but stay not-present, nothing outside of lock touches them anymore
+    size_t claimed = 0;
+
+    for(; intact && claimed < table_entries; claimed++) {
+        uint64_t entry = __atomic_load_n(&leaves[claimed], __ATOMIC_ACQUIRE);
+
+        if(!(entry & pte_migrating) || !__atomic_compare_exchange_n(&leaves[claimed], &entry, entry & ~pte_migrating, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if(claimed < table_entries) {
+        for(size_t i = 0; i < claimed; i++)
+            leaves[i] |= pte_present;
+
+        thaw_leaves(leaves, table_entries);
+
+        spin_release(&lock);
+
+        pmm::page_unref(pmm::phys_to_page(table));
+        pmm::free_huge(huge, pmm::huge_page_cnt);
+
+        return -1;
+    }
+
+    *pmd = huge | flags | pte_ps;
+    invalidate(vaddr, level_length(2));
+
+    spin_release(&lock);
+
+    shootdown();
+
+    for(size_t i = 0; i < table_entries; i++)
+        pmm::page_unref(pmm::phys_to_page(pte_base(leaves[i], 1)));
+
+    pmm::page_unref(pmm::phys_to_page(table));
+    pmm::page_unref(pmm::phys_to_page(table));
+
+    return 0;
+}
+
+// a not-present fault on a leaf the pmm is moving only has to be retried
+template <size_t levels>
+bool page_table<levels>::migrating(uint64_t vaddr) {
+    spin_lock_ack(&lock);
+
+    uint64_t *entry = walk(vaddr, 1, 0);
+    bool ret = entry && (*entry & pte_migrating);
+
+    spin_release(&lock);
+
+    return ret;
+}
+
+static void destroy_entry(uint64_t entry, size_t level) {
+    if(level > 1 && !(level <= 3 && pte_is_huge(entry))) {
+        uint64_t *table = pte_table(entry);
+
+        for(size_t i = 0; i < table_entries; i++) {
+            if(pte_is_mapped(table[i]))
+                destroy_entry(table[i], level - 1);
+        }
+    }
+
+    pmm::page *pg = pmm::phys_to_page(pte_base(entry, level));
+    if(pg)
+        pmm::page_unref(pg);
+}
+
+// drops every user frame and table of a page map that no cpu runs on anymore, the tables of the kernel half are
+// shared and stay. no tlb can hold a translation for it since its pcid is never handed to another map
+template <size_t levels>
+void page_table<levels>::destroy() {
+    spin_lock_ack(&lock);
+
+    for(size_t i = 0; i < table_entries / 2; i++) {
+        if(pte_is_present(highest_raw[i]))
+            destroy_entry(highest_raw[i], levels);
+    }
+
+    pmm::free(reinterpret_cast<uint64_t>(highest_raw) - high_vma, 1);
+    highest_raw = NULL;
+
+    spin_release(&lock);
+
+    // no cpu runs the map anymore, this only releases what is still queued
+    shootdown();
+}
+
+template struct page_table<4>;
+template struct page_table<5>;
+
+// two address spaces take turns on this cpu and touch switch_bench_pages of their own pages after every switch, so
+// the cost of a switch includes refilling the tlb when the switch threw it away
+static uint64_t switch_bench_run(pmlx_table **maps) {
+    uint64_t start = rdtsc();
+
+    for(size_t i = 0; i < switch_bench_rounds; i++) {
+        maps[i & 1]->init();
+
+        for(size_t j = 0; j < switch_bench_pages; j++)
+            (void)*reinterpret_cast<volatile uint64_t*>(switch_bench_base + j * page_size);
+    }
+
+    return (rdtsc() - start) / switch_bench_rounds;
+}
+
+// built with SWITCH_BENCH=1, compares switches that flush the tlb with ones that keep it under a pcid
+void switch_bench() {
+    if constexpr(!switch_bench_enabled)
+        return;
+
+    size_t rflags = irq_save();
+
+    pmlx_table *maps[2] = { kernel_mapping->create_generic(), kernel_mapping->create_generic() };
+    if(maps[0] == NULL || maps[1] == NULL) {
+        for(size_t i = 0; i < 2; i++) {
+            if(maps[i])
+                maps[i]->destroy();
+        }
+
+        irq_restore(rflags);
+        return;
+    }
+
+    for(size_t i = 0; i < 2; i++)
+        maps[i]->map_range(switch_bench_base, switch_bench_pages, pte_present | pte_rw, -1);
+
+    bool pcid = pcid_enabled;
+
+    pcid_enabled = false;
+    uint64_t flushed = switch_bench_run(maps);
+    pcid_enabled = pcid;
+    uint64_t tagged = switch_bench_run(maps);
+
+    print("VMM: {} cycles per switch with pcid, {} with a flush ({} pages touched)\n", tagged, flushed, switch_bench_pages);
+
+    smp::core_local().page_map->init();
+
+    for(size_t i = 0; i < 2; i++)
+        maps[i]->destroy();
+
+    irq_restore(rflags);
 }
 
 void init() {
@@ -527,18 +1158,20 @@ void init() {
         kernel_mapping = new pml4_table(pml_highest);
     }
     
-    size_t phys = 0;
-    for(size_t i = 0; i < 0x200; i++) {
-        kernel_mapping->map_page_raw(phys + kernel_high_vma, phys, 0x3 | (1 << 2), 0x3 | (1 << 7) | (1 << 8) | (1 << 2), -1);
-        phys += 0x200000;
-    }
+    kernel_mapping->map_range_raw(kernel_high_vma, 0, 0x200, 0x3 | (1 << 2), 0x3 | (1 << 7) | (1 << 8) | (1 << 2), -1);
 
-    phys = 0;
-    for(size_t i = 0; i < pmm::total_mem / 0x200000; i++) {
-        kernel_mapping->map_page_raw(phys + high_vma, phys, 0x3 | (1 << 2), 0x3 | (1 << 7) | (1 << 8) | (1 << 2), -1);
-        phys += 0x200000;
+    // the direct map goes in as one batch of 1GiB leaves when the cpu has pdpe1gb, 2MiB leaves otherwise
+    if(cpuid(0x80000001, 0).rdx & (1 << 26)) {
+        kernel_mapping->map_range_raw(high_vma, 0, div_roundup(pmm::total_mem, level_length(3)), 0x3 | (1 << 2), 0x3 | (1 << 7) | (1 << 8) | (1 << 2) | pte_giant, -1);
+    } else {
+        kernel_mapping->map_range_raw(high_vma, 0, div_roundup(pmm::total_mem, level_length(2)), 0x3 | (1 << 2), 0x3 | (1 << 7) | (1 << 8) | (1 << 2), -1);
     }
 
+    // the direct map ends on a 1GiB boundary at most, vmalloc moves to the next 512GiB above it if they would overlap
+    size_t direct_end = align_up(pmm::total_mem, level_length(3));
+    if(kmm::vmalloc_offset < direct_end)
+        kmm::vmalloc_offset = align_up(direct_end, level_length(4));
+
     set_pat();
 
     kernel_mapping->init();
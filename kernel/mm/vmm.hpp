@@ -2,6 +2,7 @@
 #define VMM_HPP_
 
 #include <memutils.hpp> 
+#include <mm/vma.hpp>
 #include <cstdint>
 #include <cstddef>
 #include <utility>
@@ -30,285 +31,174 @@ constexpr size_t pat_msr = 0x277;
 
 ssize_t set_pat();
 
-class pmle {
-public:
-    explicit pmle(uint64_t *entry) : entry(entry) { }
-    explicit pmle() = default;
-    virtual ~pmle() = default;
-
-    virtual constexpr size_t flags_p() = 0;
-    virtual constexpr size_t flags_rw() = 0;
-    virtual constexpr size_t flags_us() = 0;
-    virtual constexpr size_t flags_pwt() = 0;
-    virtual constexpr size_t flags_pcd() = 0;
-    virtual constexpr size_t flags_a() = 0;
-    virtual constexpr size_t flags_d() = 0;
-    virtual constexpr size_t flags_pat() = 0;
-    virtual constexpr size_t flags_ps() = 0;
-    virtual constexpr size_t flags_g() = 0;
-    virtual constexpr size_t flags_nx() = 0;
-
-    bool is_present() { return *entry & flags_p(); }
-    bool is_read_write() { return *entry & flags_rw(); }
-    bool is_user() { return *entry & flags_us(); }
-    bool is_write_through() { return *entry & flags_pwt(); }
-    bool is_cache_disabled() { return *entry & flags_pcd(); }
-    bool is_access() { return *entry & flags_a(); }
-    bool is_dirty() { return *entry & flags_d(); }
-    bool is_huge() { return *entry & flags_ps(); }
-    bool is_global() { return *entry & flags_g(); }
-    bool is_pat() { return *entry & flags_pat(); }
-    bool is_no_exec() { return *entry & flags_nx(); }
-
-    void set_present(bool bit) { set_bit(flags_p(), bit); }
-    void set_read_write(bool bit) { set_bit(flags_rw(), bit); }
-    void set_user(bool bit) { set_bit(flags_us(), bit); }
-    void set_write_through(bool bit) { set_bit(flags_pwt(), bit); }
-    void set_cache_disabled(bool bit) { set_bit(flags_pcd(), bit); }
-    void set_huge(bool bit) { set_bit(flags_ps(), bit); }
-    void set_global(bool bit) { set_bit(flags_g(), bit); }
-    void set_pat(bool bit) { set_bit(flags_pat(), bit); }
-    void set_no_exec(bool bit) { set_bit(flags_nx(), bit); }
-
-    void set_pa(ssize_t pa_index) {
-        set_pat(bm_test(&pa_index, 2));
-        set_cache_disabled(bm_test(&pa_index, 1));
-        set_write_through(bm_test(&pa_index, 0));
-    }
+constexpr uint64_t pte_present = 1 << 0;
+constexpr uint64_t pte_rw = 1 << 1;
+constexpr uint64_t pte_user = 1 << 2;
+constexpr uint64_t pte_pwt = 1 << 3;
+constexpr uint64_t pte_pcd = 1 << 4;
+constexpr uint64_t pte_accessed = 1 << 5;
+constexpr uint64_t pte_dirty = 1 << 6;
+constexpr uint64_t pte_ps = 1 << 7;
+constexpr uint64_t pte_pat = 1 << 7;
+constexpr uint64_t pte_global = 1 << 8;
+constexpr uint64_t pte_cow = 1 << 9; // software bit, write faults on it get a private copy
+constexpr uint64_t pte_giant = 1 << 10; // software bit, asks map_range_raw and map_page_raw for 1GiB leaves
+constexpr uint64_t pte_shared = 1 << 11; // software bit, fork leaves the page writable in both maps
+constexpr uint64_t pte_migrating = 1ull << 52; // software bit of a not-present leaf whose frame the pmm is moving
+constexpr uint64_t pte_huge_pat = 1 << 12;
+constexpr uint64_t pte_nx = 1ull << 63;
+
+constexpr uint64_t pte_addr_mask = 0x000ffffffffff000;
+constexpr uint64_t pte_huge_addr_mask = 0x000fffffffffe000;
+
+constexpr size_t table_entries = 512;
+
+inline size_t level_shift(size_t level) { return 12 + 9 * (level - 1); }
+inline size_t level_length(size_t level) { return 1ull << level_shift(level); }
+inline size_t level_index(uint64_t vaddr, size_t level) { return (vaddr >> level_shift(level)) & 0x1ff; }
+
+inline bool pte_is_present(uint64_t entry) { return entry & pte_present; }
+inline bool pte_is_huge(uint64_t entry) { return entry & pte_ps; }
+inline bool pte_is_mapped(uint64_t entry) { return entry & (pte_present | pte_migrating); }
+
+inline uint64_t pte_base(uint64_t entry, size_t level) {
+    return entry & (level == 1 ? pte_addr_mask : pte_huge_addr_mask);
+}
 
-    uint64_t get_base() { return *entry & ~(0xfff); }
-protected:
-    void set_bit(uint64_t bit, bool value) {
-        if(value) {
-            *entry |= bit;
-        } else {
-            *entry &= ~bit;
-        }
-    }
+inline uint64_t *pte_table(uint64_t entry) {
+    return reinterpret_cast<uint64_t*>((entry & pte_addr_mask) + high_vma);
+}
 
-    uint64_t *entry;
-};
+inline uint64_t pte_pa(ssize_t pa, size_t level) {
+    if(pa == -1)
+        return 0;
 
-struct pml5e : pmle {
-    pml5e(uint64_t *entry) : pmle(entry) { } 
-    pml5e() : pmle() { }
-
-    constexpr size_t flags_p() override { return 1 << 0; }
-    constexpr size_t flags_rw() override { return 1 << 1; }
-    constexpr size_t flags_us() override { return 1 << 2; }
-    constexpr size_t flags_pwt() override { return 1 << 3; }
-    constexpr size_t flags_pcd() override  { return 1 << 4; }
-    constexpr size_t flags_a() override { return 1 << 5; }
-    constexpr size_t flags_nx() override { return 1ull << 63; }
-private:
-    constexpr size_t flags_d() override { return 0; }
-    constexpr size_t flags_ps() override { return 0; }
-    constexpr size_t flags_g() override { return 0; }
-    constexpr size_t flags_pat() override { return 0; }
-};
+    uint64_t flags = 0;
+    if(pa & (1 << 0))
+        flags |= pte_pwt;
+    if(pa & (1 << 1))
+        flags |= pte_pcd;
+    if(pa & (1 << 2))
+        flags |= level == 1 ? pte_pat : pte_huge_pat;
 
-struct pml4e : pmle {
-    pml4e(uint64_t *entry) : pmle(entry) { } 
-    pml4e() : pmle() { }
-
-    constexpr size_t flags_p() override { return 1 << 0; }
-    constexpr size_t flags_rw() override { return 1 << 1; }
-    constexpr size_t flags_us() override { return 1 << 2; }
-    constexpr size_t flags_pwt() override { return 1 << 3; }
-    constexpr size_t flags_pcd() override { return 1 << 4; }
-    constexpr size_t flags_a() override { return 1 << 5; }
-    constexpr size_t flags_nx() override { return 1ull << 63; }
-private:
-    constexpr size_t flags_d() override { return 0; }
-    constexpr size_t flags_ps() override { return 0; }
-    constexpr size_t flags_g() override { return 0; }
-    constexpr size_t flags_pat() override { return 0; }
-};
+    return flags;
+}
 
-struct pml3e : pmle {
-    pml3e(uint64_t *entry) : pmle(entry) { } 
-    pml3e() : pmle() { }
-
-    constexpr size_t flags_p() override { return 1 << 0; }
-    constexpr size_t flags_rw() override { return 1 << 1; }
-    constexpr size_t flags_us() override { return 1 << 2; }
-    constexpr size_t flags_pwt() override { return 1 << 3; }
-    constexpr size_t flags_pcd() override { return 1 << 4; }
-    constexpr size_t flags_a() override { return 1 << 5; }
-    constexpr size_t flags_d() override { return 1 << 6; }
-    constexpr size_t flags_ps() override { return 1 << 7; }
-    constexpr size_t flags_g() override { return 1 << 8; }
-    constexpr size_t flags_pat() override { return 1 << 12; }
-    constexpr size_t flags_nx() override { return 1ull << 63; }
-};
+inline uint64_t pte_set_pa(uint64_t entry, ssize_t pa, size_t level) {
+    if(pa == -1)
+        return entry;
 
-struct pml2e : pmle {
-    pml2e(uint64_t *entry) : pmle(entry) { } 
-    pml2e() : pmle() { }
-
-    constexpr size_t flags_p() override { return 1 << 0; }
-    constexpr size_t flags_rw() override { return 1 << 1; }
-    constexpr size_t flags_us() override { return 1 << 2; }
-    constexpr size_t flags_pwt() override { return 1 << 3; }
-    constexpr size_t flags_pcd() override { return 1 << 4; }
-    constexpr size_t flags_a() override { return 1 << 5; }
-    constexpr size_t flags_d() override { return 1 << 6; }
-    constexpr size_t flags_ps() override { return 1 << 7; }
-    constexpr size_t flags_g() override { return 1 << 8; }
-    constexpr size_t flags_pat() override { return 1 << 12; }
-    constexpr size_t flags_nx() override { return 1ull << 63; }
-};
+    entry &= ~(pte_pwt | pte_pcd | (level == 1 ? pte_pat : pte_huge_pat));
 
-struct pml1e : pmle {
-    pml1e(uint64_t *entry) : pmle(entry) { } 
-    pml1e() : pmle() { }
-
-    constexpr size_t flags_p() override { return 1 << 0; }
-    constexpr size_t flags_rw() override { return 1 << 1; }
-    constexpr size_t flags_us() override { return 1 << 2; }
-    constexpr size_t flags_pwt() override { return 1 << 3; }
-    constexpr size_t flags_pcd() override { return 1 << 4; }
-    constexpr size_t flags_a() override { return 1 << 5; }
-    constexpr size_t flags_d() override { return 1 << 6; }
-    constexpr size_t flags_pat() override { return 1 << 7; }
-    constexpr size_t flags_g() override { return 1 << 8; }
-    constexpr size_t flags_nx() override { return 1ull << 63; }
-private:
-    constexpr size_t flags_ps() override { return 0; }
-};
+    return entry | pte_pa(pa, level);
+}
+
+constexpr size_t pcid_cnt = 8;
+constexpr uint64_t cr3_no_flush = 1ull << 63;
+
+inline bool pcid_enabled = false;
+inline bool invpcid_enabled = false;
+
+inline uint64_t next_ctx_id = 1;
 
 struct pmlx_table {
-    explicit pmlx_table(uint64_t *highest) : highest_raw(highest), lock(0) { }
-    explicit pmlx_table() : highest_raw(0), lock(0) { } 
+    explicit pmlx_table(uint64_t *highest) : vmas(), vma_lock(0), highest_raw(highest), lock(0),
+                                            tlb_start(-1), tlb_end(0), stale(NULL), stale_cnt(0), tlb_gen(0), ctx_id(__atomic_fetch_add(&next_ctx_id, 1, __ATOMIC_RELAXED)) { }
+    explicit pmlx_table() : vmas(), vma_lock(0), highest_raw(0), lock(0),
+                            tlb_start(-1), tlb_end(0), stale(NULL), stale_cnt(0), tlb_gen(0), ctx_id(__atomic_fetch_add(&next_ctx_id, 1, __ATOMIC_RELAXED)) { } 
 
-    virtual void map_range(uint64_t vaddr, size_t cnt, size_t flags, ssize_t pa) = 0;
-    virtual void unmap_range(uint64_t vaddr, size_t cnt) = 0;
+    virtual ssize_t map_range(uint64_t vaddr, size_t cnt, size_t flags, ssize_t pa) = 0;
+    virtual void map_range_raw(uint64_t vaddr, uint64_t paddr, size_t cnt, uint64_t flags1, uint64_t flags0, ssize_t pa) = 0;
+    virtual void unmap_range(uint64_t vaddr, size_t cnt, bool release = false) = 0;
 
     virtual void map_page_raw(uint64_t vaddr, uint64_t paddr, uint64_t flags1, uint64_t flags0, ssize_t pa) = 0;
     virtual void map_page(uint64_t vaddr, uint64_t flags, ssize_t pa) = 0;
-    virtual void unmap_page(uint64_t vaddr) = 0;
+    virtual ssize_t map_frame(uint64_t vaddr, uint64_t paddr, uint64_t flags) = 0;
+    virtual uint64_t unmap_page(uint64_t vaddr) = 0;
 
     virtual pmlx_table *create_generic() = 0;
-
-    void init() {
-        asm volatile ("mov %0, %%cr3" :: "r" (reinterpret_cast<uint64_t>(highest_raw) - high_vma) : "memory");
+    virtual pmlx_table *fork() = 0;
+    virtual ssize_t break_cow(uint64_t vaddr) = 0;
+    virtual ssize_t collapse(uint64_t vaddr) = 0;
+    virtual bool migrating(uint64_t vaddr) = 0;
+    virtual void destroy() = 0;
+
+    virtual uint64_t user_end() = 0;
+
+    void init();
+
+    // queue [vaddr, vaddr + length) for the next shootdown, lock must be held
+    void invalidate(uint64_t vaddr, size_t length) {
+        if(vaddr < tlb_start)
+            tlb_start = vaddr;
+        if(vaddr + length > tlb_end)
+            tlb_end = vaddr + length;
     }
 
-    uint8_t *bitmap;
-    size_t bm_size;
+    // drop a reference on paddr once the next shootdown is done, lock must be held
+    void release_later(uint64_t paddr);
+
+    // flushes the queued range and then releases the queued frames. paths that hold vma_lock only queue, and
+    // shoot down after dropping it so no cpu spinning on vma_lock with interrupts off is left waiting on
+    void shootdown();
+
+    mm::vma_tree vmas;
+    size_t vma_lock;
 
     uint64_t *highest_raw;
     uint64_t lock;
-};
-
-struct pml4_table : pmlx_table {
-    pml4_table(uint64_t *highest) : pmlx_table(highest) { } 
-    pml4_table() : pmlx_table() { } 
 
-    void map_range(uint64_t vaddr, size_t cnt, size_t flags, ssize_t pa);
-    void unmap_range(uint64_t vaddr, size_t cnt);
+    uint64_t tlb_start;
+    uint64_t tlb_end;
 
-    void map_page_raw(uint64_t vaddr, uint64_t paddr, uint64_t flags1, uint64_t flags0, ssize_t pa);
-    void map_page(uint64_t vaddr, uint64_t flags, ssize_t pa);
-    void unmap_page(uint64_t vaddr);
+    // chain of pmm frames holding the frames to release, entry 0 of each links to the previous one
+    uint64_t *stale;
+    size_t stale_cnt;
 
-    pmlx_table *create_generic();
+    // bumped by every user range shootdown, a cpu holding a pcid for this table with an older generation reloads it with a flush
+    uint64_t tlb_gen;
+    uint64_t ctx_id;
+};
 
-    class virtual_address {
-    public:
-        virtual_address(uint64_t *pml4_raw, uint64_t vaddr, uint64_t paddr);
-        virtual_address(uint64_t *pml4_raw, uint64_t vaddr);
-        virtual_address() : pml4_raw(0) { }
-        ~virtual_address() { delete _pml4e; delete _pml3e; delete _pml2e; delete _pml1e; }
-
-        void map(uint64_t pml4_flags, uint64_t pml3_flags, uint64_t pml2_flags, uint64_t pml1_flags, ssize_t pa);
-        uint64_t unmap();
-
-        void compute_indices() {
-            pml4_idx = (vaddr >> 39) & 0x1ff;
-            pml3_idx = (vaddr >> 30) & 0x1ff;
-            pml2_idx = (vaddr >> 21) & 0x1ff;
-            pml1_idx = (vaddr >> 12) & 0x1ff;
-        }
-
-        pml4e *_pml4e;
-        pml3e *_pml3e;
-        pml2e *_pml2e;
-        pml1e *_pml1e;
-
-        uint64_t page_length;
-    private:
-        uint64_t vaddr;
-        uint64_t paddr;
-
-        size_t pml4_idx;
-        size_t pml3_idx;
-        size_t pml2_idx;
-        size_t pml1_idx;
-
-        uint64_t *pml4_raw;
-        uint64_t *pml3_raw;
-        uint64_t *pml2_raw;
-        uint64_t *pml1_raw;
-    };
+struct pcid_slot {
+    uint64_t ctx_id;
+    uint64_t tlb_gen;
 };
 
-struct pml5_table : pmlx_table {
-    pml5_table(uint64_t *highest) : pmlx_table(highest) { } 
-    pml5_table() : pmlx_table() { } 
+// levels is the paging depth (4 or 5) picked once in vmm::init, every walk is unrolled against it
+template <size_t levels>
+struct page_table : pmlx_table {
+    page_table(uint64_t *highest) : pmlx_table(highest) { } 
+    page_table() : pmlx_table() { } 
 
-    void map_range(uint64_t vaddr, size_t cnt, size_t flags, ssize_t pa);
-    void unmap_range(uint64_t vaddr, size_t cnt);
+    ssize_t map_range(uint64_t vaddr, size_t cnt, size_t flags, ssize_t pa);
+    void map_range_raw(uint64_t vaddr, uint64_t paddr, size_t cnt, uint64_t flags1, uint64_t flags0, ssize_t pa);
+    void unmap_range(uint64_t vaddr, size_t cnt, bool release = false);
 
     void map_page_raw(uint64_t vaddr, uint64_t paddr, uint64_t flags1, uint64_t flags0, ssize_t pa);
     void map_page(uint64_t vaddr, uint64_t flags, ssize_t pa);
-    void unmap_page(uint64_t vaddr);
+    ssize_t map_frame(uint64_t vaddr, uint64_t paddr, uint64_t flags);
+    uint64_t unmap_page(uint64_t vaddr);
 
     pmlx_table *create_generic();
-
-    class virtual_address {
-    public:
-        virtual_address(uint64_t *pml5_raw, uint64_t vaddr, uint64_t paddr);
-        virtual_address(uint64_t *pml5_raw, uint64_t vaddr);
-        virtual_address() : pml5_raw(0) { }
-        ~virtual_address() { delete _pml5e; delete _pml4e; delete _pml3e; delete _pml2e; delete _pml1e; }
-
-        void map(uint64_t pml5_flags, uint64_t pml4_flags, uint64_t pml3_flags, uint64_t pml2_flags, uint64_t pml1_flags, ssize_t pa);
-        uint64_t unmap();
-
-        void compute_indices() {
-            pml5_idx = (vaddr >> 48) & 0x1ff;
-            pml4_idx = (vaddr >> 39) & 0x1ff;
-            pml3_idx = (vaddr >> 30) & 0x1ff;
-            pml2_idx = (vaddr >> 21) & 0x1ff;
-            pml1_idx = (vaddr >> 12) & 0x1ff;
-        }
-
-        pml5e *_pml5e;
-        pml4e *_pml4e;
-        pml3e *_pml3e;
-        pml2e *_pml2e;
-        pml1e *_pml1e;
-
-        uint64_t page_length;
-    private:
-        uint64_t vaddr;
-        uint64_t paddr;
-
-        size_t pml5_idx;
-        size_t pml4_idx;
-        size_t pml3_idx;
-        size_t pml2_idx;
-        size_t pml1_idx;
-
-        uint64_t *pml5_raw;
-        uint64_t *pml4_raw;
-        uint64_t *pml3_raw;
-        uint64_t *pml2_raw;
-        uint64_t *pml1_raw;
-    };
+    pmlx_table *fork();
+    ssize_t break_cow(uint64_t vaddr);
+    ssize_t collapse(uint64_t vaddr);
+    bool migrating(uint64_t vaddr);
+    void destroy();
+
+    // the lower half of the canonical address space, 47 bits with 4 levels and 56 with 5
+    uint64_t user_end() { return 1ull << (level_shift(levels) + 8); }
+
+    uint64_t *walk(uint64_t vaddr, size_t level, uint64_t table_flags);
+    uint64_t *lookup(uint64_t vaddr, size_t *level);
+    bool split_to(uint64_t vaddr, size_t level);
+    void prune(uint64_t vaddr);
 };
 
+using pml4_table = page_table<4>;
+using pml5_table = page_table<5>;
+
 pmlx_table *create_generic_map();
 
 inline uint64_t get_pml4() {
@@ -321,11 +211,60 @@ inline void tlb_flush() {
     asm volatile ("mov %0, %%cr3" :: "r" (get_pml4()) : "memory");
 }
 
-inline void invplg(uint64_t vaddr) {
-    asm volatile ("invplg %0" :: "m"(vaddr) : "memory");
+inline void tlb_flush_global() {
+    uint64_t cr4;
+    asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+    asm volatile ("mov %0, %%cr4" :: "r"(cr4 & ~(1ull << 7)) : "memory");
+    asm volatile ("mov %0, %%cr4" :: "r"(cr4) : "memory");
+}
+
+inline void invlpg(uint64_t vaddr) {
+    asm volatile ("invlpg (%0)" :: "r"(vaddr) : "memory");
+}
+
+constexpr uint64_t invpcid_address = 0;
+constexpr uint64_t invpcid_context = 1;
+constexpr uint64_t invpcid_all_global = 2;
+constexpr uint64_t invpcid_all = 3;
+
+inline void invpcid(uint64_t type, uint64_t pcid, uint64_t vaddr) {
+    struct [[gnu::packed]] {
+        uint64_t pcid;
+        uint64_t vaddr;
+    } desc = { pcid, vaddr };
+
+    asm volatile ("invpcid %0, %1" :: "m"(desc), "r"(type) : "memory");
+}
+
+#ifdef SWITCH_BENCH
+constexpr bool switch_bench_enabled = true;
+#else
+constexpr bool switch_bench_enabled = false;
+#endif
+
+constexpr size_t switch_bench_rounds = 10000;
+constexpr size_t switch_bench_pages = 64;
+constexpr uint64_t switch_bench_base = 0x100000000;
+
+constexpr size_t invlpg_max = 32;
+constexpr size_t tlb_shootdown_vector = 34;
+
+void tlb_invalidate(uint64_t start, uint64_t end);
+void tlb_shootdown(pmlx_table *page_map, uint64_t start, uint64_t end);
+void tlb_shootdown_handler(regs *regs_cur);
+void tlb_shootdown_ack();
+
+// spin_lock for locks taken with interrupts off, a holder waiting on a shootdown still gets this cpu's ack
+template <typename T>
+void spin_lock_ack(T *lock) {
+    while(!spin_trylock(lock)) {
+        tlb_shootdown_ack();
+        asm ("pause");
+    }
 }
 
 void init();
+void switch_bench();
 
 inline pmlx_table *kernel_mapping;
 
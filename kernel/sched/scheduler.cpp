@@ -9,9 +9,23 @@ namespace sched {
 static size_t thread_cnt = 0;
 static size_t task_cnt = 0;
 
-ssize_t create_task(ssize_t ppid, vmm::pmlx_table *page_map) {
+static void thread_ctor(void *obj) {
+    thread *new_thread = new (obj) thread;
+    new_thread->kernel_stack = pmm::alloc(div_roundup(thread_stack_size, vmm::page_size));
+}
+
+static void thread_dtor(void *obj) {
+    thread *old_thread = reinterpret_cast<thread*>(obj);
+    pmm::free(old_thread->kernel_stack, div_roundup(thread_stack_size, vmm::page_size));
+}
+
+static kmm::object_cache<thread> thread_cache("thread", kmm::cache_cacheline_aligned, thread_ctor, thread_dtor);
+
+ssize_t create_task(ssize_t ppid, vmm::pmlx_table *page_map, size_t flags) {
     task new_task;
 
+    new_task.flags = flags;
+
     if(task_list[ppid].pid != -1)
         new_task.ppid = ppid;
     else
@@ -26,8 +40,14 @@ ssize_t create_task(ssize_t ppid, vmm::pmlx_table *page_map) {
         new_task.page_map = vmm::kernel_mapping;
     } 
 
+    size_t rflags = irq_save();
+    spin_lock(&scheduler_lock);
+
     task_list[new_task.pid = task_cnt++] = new_task;
 
+    spin_release(&scheduler_lock);
+    irq_restore(rflags);
+
     return new_task.pid;
 }
 
@@ -35,14 +55,19 @@ ssize_t create_thread(ssize_t pid, uint64_t rip, uint16_t cs, elf::aux *aux, con
     if(task_list[pid].pid == -1)
         return -1;
 
-    thread new_thread;
+    thread &new_thread = *thread_cache.alloc();
+
+    memset8(reinterpret_cast<uint8_t*>(&new_thread.regs_cur), 0, sizeof(regs));
+
+    new_thread.tid = -1;
+    new_thread.idle_cnt = 0;
+    new_thread.errno = 0;
 
     new_thread.regs_cur.rip = rip;
     new_thread.regs_cur.cs = cs;
     new_thread.regs_cur.rflags = 0x202;
 
     new_thread.status = task_waiting;
-    new_thread.kernel_stack = pmm::alloc(2);
     new_thread.user_gs_base = 0;
     new_thread.user_fs_base = 0;
     new_thread.user_stack = 0;
@@ -110,42 +135,92 @@ ssize_t create_thread(ssize_t pid, uint64_t rip, uint16_t cs, elf::aux *aux, con
         new_thread.regs_cur.rsp = (uint64_t)stack;
     } else {
         new_thread.regs_cur.ss = cs + 8;
-        new_thread.regs_cur.rsp = new_thread.kernel_stack + vmm::high_vma;
+        new_thread.regs_cur.rsp = new_thread.kernel_stack + thread_stack_size + vmm::high_vma;
     }
 
-    task_list[pid].threads[new_thread.tid = thread_cnt++] = new_thread;
+    size_t rflags = irq_save();
+    spin_lock(&scheduler_lock);
+
+    task_list[pid].threads[new_thread.tid = thread_cnt++] = &new_thread;
+
+    spin_release(&scheduler_lock);
+    irq_restore(rflags);
 
     return new_thread.tid;
 }
 
+// for an interrupt that has nothing left to return to, the cpu idles on its own stack until a later tick finds work.
+// scheduler_lock must be held and the kernel gs base loaded
+[[noreturn]] static void park(smp::cpu &cpu_local) {
+    apic::lapic->write(apic::lapic->eoi(), 0);
+    spin_release(&scheduler_lock);
+
+    asm volatile ("mov %0, %%rsp\n" "sti\n" "1: hlt\n" "jmp 1b" :: "r"(cpu_local.kernel_stack) : "memory");
+    __builtin_unreachable();
+}
+
 void reschedule(regs *regs_cur) {
     spin_lock(&scheduler_lock);
 
     if(regs_cur->cs & 0x3)
         swapgs();
 
-    auto next_pid = []() {
+    smp::cpu &cpu_local = smp::core_local();
+
+    // a thread of a task that exited on another cpu is dropped once it is back in user mode, in the kernel it may
+    // still hold locks so it runs on until then
+    bool dropped = false;
+
+    if(cpu_local.pid != -1 && task_list[cpu_local.pid].status == task_exited) {
+        if(!(regs_cur->cs & 0x3)) {
+            spin_release(&scheduler_lock);
+            return;
+        }
+
+        cpu_local.pid = -1;
+        cpu_local.tid = -1;
+
+        cpu_local.page_map = vmm::kernel_mapping;
+        cpu_local.page_map->init();
+
+        dropped = true;
+    }
+
+    auto next_pid = [&]() {
         ssize_t ret = -1;
+        ssize_t idle = -1;
 
-        for(size_t i = 0, cnt = 0; i < task_list.size(); i++) {
+        for(size_t i = 0, cnt = 0, idle_cnt = 0; i < task_list.size(); i++) {
             task &next_task = task_list[task_list.get_tag(i)];
             next_task.idle_cnt++;
 
-            if(next_task.status == task_waiting && cnt < next_task.idle_cnt) {
+            if(next_task.status != task_waiting)
+                continue;
+
+            if(next_task.flags & task_idle) {
+                if(idle_cnt < next_task.idle_cnt) {
+                    idle_cnt = next_task.idle_cnt;
+                    idle = next_task.pid;
+                }
+            } else if(cnt < next_task.idle_cnt) {
                 cnt = next_task.idle_cnt;
                 ret = next_task.pid;
             }
         }
         
-        return ret;
-    } ();
+        if(ret == -1 && cpu_local.pid != -1 && !(task_list[cpu_local.pid].flags & task_idle))
+            return ret;
 
-    smp::cpu &cpu_local = smp::core_local();
+        return ret != -1 ? ret : idle;
+    } ();
 
     if(next_pid == -1) {
         if(cpu_local.pid != -1) {
             next_pid = cpu_local.pid;
         } else {
+            if(dropped)
+                park(cpu_local);
+
             if(regs_cur->cs & 0x3)
                 swapgs();
             spin_release(&scheduler_lock);
@@ -159,7 +234,7 @@ void reschedule(regs *regs_cur) {
         ssize_t ret = -1;
 
         for(size_t i = 0, cnt = 0; i < next_task.threads.size(); i++) {
-            thread &next_thread = next_task.threads[next_task.threads.get_tag(i)];
+            thread &next_thread = *next_task.threads[next_task.threads.get_tag(i)];
             next_thread.idle_cnt++;
 
             if(next_thread.status == task_waiting && cnt < next_thread.idle_cnt) {
@@ -172,17 +247,20 @@ void reschedule(regs *regs_cur) {
     } ();
 
     if(next_tid == -1) {
+        if(dropped)
+            park(cpu_local);
+
         if(regs_cur->cs & 0x3)
             swapgs();
         spin_release(&scheduler_lock);
         return;
     }
 
-    thread &next_thread = task_list[next_pid].threads[next_tid];
+    thread &next_thread = *task_list[next_pid].threads[next_tid];
 
     if(cpu_local.tid != -1 && cpu_local.pid != -1) {
         task &last_task = task_list[cpu_local.pid];
-        thread &last_thread = last_task.threads[cpu_local.tid];
+        thread &last_thread = *last_task.threads[cpu_local.tid];
 
         last_thread.status = task_waiting;
         last_task.status = task_waiting;
@@ -214,7 +292,170 @@ void reschedule(regs *regs_cur) {
     apic::lapic->write(apic::lapic->eoi(), 0);
     spin_release(&scheduler_lock);
 
-    switch_task((uint64_t)&task_list[next_pid].threads[next_tid].regs_cur);
+    switch_task((uint64_t)&next_thread.regs_cur);
+}
+
+// the child shares every user frame copy-on-write and resumes from the same syscall with rax = 0. the address space is
+// copied with interrupts on since it waits for a tlb shootdown, task_list is only touched under scheduler_lock
+ssize_t fork(regs *regs_cur) {
+    smp::cpu &core = smp::core_local();
+
+    ssize_t ppid = core.pid;
+    ssize_t ptid = core.tid;
+    size_t errno = core.errno;
+
+    vmm::pmlx_table *page_map = mm::fork(task_list[ppid].page_map);
+    if(page_map == NULL) {
+        set_errno(enomem);
+        return -1;
+    }
+
+    ssize_t pid = create_task(ppid, page_map, task_list[ppid].flags);
+
+    thread &new_thread = *thread_cache.alloc();
+
+    asm ("cli");
+    spin_lock(&scheduler_lock);
+
+    task &parent = task_list[ppid];
+    task &child = task_list[pid];
+    thread &parent_thread = *parent.threads[ptid];
+
+    child.fd_list.bitmap = NULL;
+    child.fd_list.bitmap_size = 0;
+
+    if(parent.fd_list.bitmap != NULL) {
+        child.fd_list.bitmap_size = parent.fd_list.bitmap_size;
+        child.fd_list.bitmap = (uint8_t*)kmm::alloc(child.fd_list.bitmap_size);
+        memcpy8(child.fd_list.bitmap, parent.fd_list.bitmap, child.fd_list.bitmap_size);
+    }
+
+    new_thread.idle_cnt = 0;
+    new_thread.errno = errno;
+    new_thread.status = task_waiting;
+    new_thread.user_gs_base = get_user_gs();
+    new_thread.user_fs_base = get_user_fs();
+    new_thread.user_stack = parent_thread.user_stack;
+
+    new_thread.regs_cur = *regs_cur;
+    new_thread.regs_cur.rax = 0;
+
+    child.threads[new_thread.tid = thread_cnt++] = &new_thread;
+
+    spin_release(&scheduler_lock);
+    asm ("sti");
+
+    return pid;
+}
+
+extern "C" void syscall_fork(regs *regs_cur) {
+    regs_cur->rax = fork(regs_cur);
+}
+
+// runs on the cpu's own stack with interrupts off. the other threads of the task are kicked off their cpus first,
+// so no stack, thread or page table is released while something still runs on it
+[[noreturn]] static void exit_finish() {
+    smp::cpu &core = smp::core_local();
+
+    spin_lock(&scheduler_lock);
+
+    ssize_t pid = core.pid;
+    task &current_task = task_list[pid];
+    vmm::pmlx_table *page_map = current_task.page_map;
+
+    current_task.status = task_exited;
+
+    for(size_t i = 0; i < current_task.threads.size(); i++)
+        current_task.threads[current_task.threads.get_tag(i)]->status = task_exited;
+
+    core.pid = -1;
+    core.tid = -1;
+
+    core.page_map = vmm::kernel_mapping;
+    core.page_map->init();
+
+    auto runs_task = [&](smp::cpu &cpu) {
+        return cpu.index != core.index && cpu.online && (cpu.pid == pid || (page_map != vmm::kernel_mapping && cpu.page_map == page_map));
+    };
+
+    for(size_t i = 0; i < smp::cpus.size(); i++) {
+        if(runs_task(smp::cpus[i]))
+            apic::lapic->send_ipi(smp::cpus[i].apic_id, reschedule_vector);
+    }
+
+    spin_release(&scheduler_lock);
+
+    for(;;) {
+        spin_lock(&scheduler_lock);
+
+        bool busy = false;
+        for(size_t i = 0; i < smp::cpus.size(); i++)
+            busy |= runs_task(smp::cpus[i]);
+
+        if(!busy)
+            break;
+
+        spin_release(&scheduler_lock);
+
+        vmm::tlb_shootdown_ack();
+        asm ("pause");
+    }
+
+    // task_list may have grown while the lock was dropped
+    task &dead_task = task_list[pid];
+
+    for(size_t i = 0; i < dead_task.threads.size(); i++)
+        thread_cache.free(dead_task.threads[dead_task.threads.get_tag(i)]);
+
+    dead_task.threads = lib::map<ssize_t, thread*>();
+
+    // fork copies the fd bitmap without its own fds, one another live task still has is left open for it
+    uint8_t *fds = dead_task.fd_list.bitmap;
+    size_t fd_cnt = dead_task.fd_list.bitmap_size;
+
+    for(size_t i = 0; fds && i < fd_cnt; i++) {
+        if(!bm_test(fds, i))
+            continue;
+
+        for(size_t j = 0; j < task_list.size(); j++) {
+            task &other = task_list[task_list.get_tag(j)];
+
+            if(other.pid != pid && other.pid != -1 && !(other.status & task_exited) && i < other.fd_list.bitmap_size && bm_test(other.fd_list.bitmap, i)) {
+                bm_clear(fds, i);
+                break;
+            }
+        }
+    }
+
+    dead_task.fd_list.bitmap = NULL;
+    dead_task.fd_list.bitmap_size = 0;
+
+    spin_release(&scheduler_lock);
+
+    // memfd objects are closed before their mappings go, the frames are freed once the last of the two is dropped
+    if(fds) {
+        fs::close_all(fds, fd_cnt);
+        kmm::free(fds);
+    }
+
+    if(page_map != vmm::kernel_mapping)
+        mm::destroy(page_map);
+
+    for(;;)
+        asm ("sti\n" "hlt");
+}
+
+// the calling task is left behind as an exited entry. a kernel thread calls this on its own stack, which goes with
+// the thread, so the rest runs on the cpu's stack and this cpu waits for the next timer tick to pick other work
+void exit() {
+    asm ("cli");
+
+    asm volatile ("mov %0, %%rsp\n" "call %P1" :: "r"(smp::core_local().kernel_stack), "i"(exit_finish) : "memory");
+    __builtin_unreachable();
+}
+
+extern "C" void syscall_exit(regs*) {
+    exit();
 }
 
 ssize_t sched_task(lib::string path, uint16_t cs, const char **argv, const char **envp) { 
@@ -226,9 +467,17 @@ ssize_t sched_task(lib::string path, uint16_t cs, const char **argv, const char
 
     ssize_t ppid = core.pid;
 
+    vmm::pmlx_table *page_map = core.page_map->create_generic();
+    if(page_map == NULL) {
+        set_errno(enomem);
+        return -1;
+    }
+
     asm ("cli");
 
-    vmm::pmlx_table *page_map = core.page_map->create_generic();
+    vmm::pmlx_table *kernel_map = core.page_map;
+
+    core.page_map = page_map; // lets the fault handler back the new stack and segments
     page_map->init();
 
     lib::string *ld_path = NULL;
@@ -240,8 +489,12 @@ ssize_t sched_task(lib::string path, uint16_t cs, const char **argv, const char
 
     if(ld_path != NULL) {
         fs::fd ld_file(*ld_path, 0, 0);
-        if(ld_file.status == 0)
+        if(ld_file.status == 0) {
+            core.page_map = kernel_map;
+            core.page_map->init();
+            asm ("sti");
             return -1;
+        }
 
         elf::aux ld_aux;
         elf::file(page_map, &ld_aux, ld_file, 0x40000000, NULL);
@@ -252,6 +505,7 @@ ssize_t sched_task(lib::string path, uint16_t cs, const char **argv, const char
     ssize_t pid = create_task(ppid, page_map);
     create_thread(pid, entry_point, cs, &aux, argv, envp);
 
+    core.page_map = kernel_map;
     core.page_map->init();
 
     asm ("sti");
@@ -11,12 +11,16 @@ namespace sched {
 constexpr size_t task_waiting = (1 << 1);
 constexpr size_t task_waiting_to_start = (1 << 2);
 constexpr size_t task_running = (1 << 3);
+constexpr size_t task_exited = (1 << 0);
 
 constexpr size_t task_user = (1 << 4);
 constexpr size_t task_elf = (1 << 5);
+constexpr size_t task_idle = (1 << 6);
 
 constexpr size_t thread_stack_size = 0x2000;
 
+constexpr size_t reschedule_vector = 32;
+
 extern "C" void switch_task(uint64_t rsp);
 
 struct thread {
@@ -36,13 +40,14 @@ struct thread {
 };
 
 struct task {
-    task() : pid(-1), ppid(-1), idle_cnt(0) { }
+    task() : pid(-1), ppid(-1), idle_cnt(0), flags(0), fd_list({ NULL, 0 }) { }
   
     pid_t pid;
     pid_t ppid;
     size_t idle_cnt;
     size_t status;
-    lib::map<ssize_t, thread> threads;
+    size_t flags;
+    lib::map<ssize_t, thread*> threads;
 
     struct {
         uint8_t *bitmap;
@@ -53,9 +58,11 @@ struct task {
     vmm::pmlx_table *page_map;
 };
 
-ssize_t create_task(ssize_t pid, vmm::pmlx_table *page_map);
+ssize_t create_task(ssize_t pid, vmm::pmlx_table *page_map, size_t flags = 0);
 ssize_t create_thread(ssize_t ppid, uint64_t rip, uint16_t cs, elf::aux *aux, const char **argv, const char **envp);
 ssize_t sched_task(lib::string path, uint16_t cs, const char **argv, const char **envp);
+ssize_t fork(regs *regs_cur);
+[[noreturn]] void exit();
 void reschedule(regs *regs_cur);
 
 inline size_t scheduler_lock = 0;
@@ -1,4 +1,5 @@
 #include <sched/smp.hpp>
+#include <mm/numa.hpp>
 #include <acpi/madt.hpp>
 #include <int/idt.hpp>
 #include <int/apic.hpp>
@@ -21,19 +22,23 @@ static void prep_core(size_t stack, uint64_t pml4, uint64_t entry, uint64_t idt,
 }
 
 static void core_bootstrap(size_t core_index) {
-    new x86::tss;
-
     wrmsr(msr_gs_base, reinterpret_cast<size_t>(&cpus.data()[core_index]));
 
+    new x86::tss;
+
     apic::x2apic();
     apic::timer_calibrate(100);
     apic::lapic->write(apic::lapic->sint(), apic::lapic->read(apic::lapic->sint()) | 0x1ff);
-    asm volatile ("mov %0, %%cr8\nsti" :: "r"(0ull));
 
+    // before sti, the first tick switches to a task and never comes back here
     vmm::set_pat();
 
     cpu_init_features();
 
+    asm volatile ("mov %0, %%cr8\nsti" :: "r"(0ull));
+
+    __atomic_store_n(&cpus[core_index].online, true, __ATOMIC_RELEASE);
+
     for(;;)
         asm ("pause");
 }
@@ -54,27 +59,38 @@ void boot_aps() {
     vmm::kernel_mapping->map_page_raw(0, 0, 0x3, 0x3 | (1 << 7) | (1 << 8), -1); 
 
     for(size_t i = 0; i < madt0_list.size(); i++) {
-        madt0 madt0_entry = madt0_list[i];
-        uint32_t apic_id = madt0_entry.apic_id;
+        size_t numa_node = numa::apic_node(madt0_list[i].apic_id);
 
-        cpu new_cpu = { 0,
-                        pmm::alloc(2) + 0x2000 + vmm::high_vma,
+        cpu new_cpu = { i,
+                        pmm::alloc_node(2, numa_node) + 0x2000 + vmm::high_vma,
+                        0,
                         0,
                         -1,
                         -1,
                         vmm::kernel_mapping,
-                        NULL
+                        NULL,
+                        numa_node,
+                        { },
+                        madt0_list[i].apic_id,
+                        false
                       };
 
         cpus.push(new_cpu);
+    }
+
+    for(size_t i = 0; i < madt0_list.size(); i++) {
+        madt0 madt0_entry = madt0_list[i];
+        uint32_t apic_id = madt0_entry.apic_id;
 
         if(apic_id == current_apic_id) {
             wrmsr(msr_gs_base, reinterpret_cast<size_t>(&cpus.data()[i]));
+            cpus[i].online = true;
+            percpu_online = true;
             continue;
         }
 
         if(madt0_entry.flags == 1) {
-            prep_core(  new_cpu.kernel_stack,
+            prep_core(  cpus[i].kernel_stack,
                         reinterpret_cast<uint64_t>(vmm::kernel_mapping->highest_raw),
                         reinterpret_cast<uint64_t>(core_bootstrap),
                         reinterpret_cast<uint64_t>(&idtr),
@@ -89,6 +105,7 @@ void boot_aps() {
     }
 
     vmm::kernel_mapping->unmap_page(0);
+    vmm::kernel_mapping->shootdown();
 }
 
 cpu &core_local() {
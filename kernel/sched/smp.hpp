@@ -3,25 +3,32 @@
 
 #include <drivers/nvme/nvme.hpp>
 #include <mm/vmm.hpp>
+#include <mm/pmm.hpp>
 #include <vector.hpp>
 #include <types.hpp>
 
 namespace smp {
 
 struct cpu {
-    uint64_t user_stack;
+    uint64_t index;
     uint64_t kernel_stack;
+    uint64_t user_stack;
     ssize_t errno;
     pid_t pid;
     tid_t tid;
     vmm::pmlx_table *page_map;
     nvme::queue *nvme_io_queue;
+    size_t numa_node;
+    pmm::frame_cache frame_cache;
+    uint32_t apic_id;
+    bool online;
 };
 
 void boot_aps();
 cpu &core_local();
 
 inline lib::vector<cpu> cpus;
+inline bool percpu_online = false;
 
 }
 